@@ -1,5 +1,9 @@
 #include "opus_codec_core.h"
 
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 // Helper function to get closest supported Opus sample rate
 static int get_opus_sample_rate(int host_rate) {
     // Opus supports: 8000, 12000, 16000, 24000, 48000 Hz
@@ -10,6 +14,90 @@ static int get_opus_sample_rate(int host_rate) {
     return 48000;  // Default to 48kHz for rates above 24kHz
 }
 
+#ifdef OPUS_CODEC_CUSTOM_MODES
+#define CODEC_ENCODER_CTL(codec, request) ((codec)->custom_encoder ? \
+    opus_custom_encoder_ctl((codec)->custom_encoder, request) : \
+    opus_encoder_ctl((codec)->encoder, request))
+#else
+#define CODEC_ENCODER_CTL(codec, request) opus_encoder_ctl((codec)->encoder, request)
+#endif
+
+// Allocate frame, packet and ring buffers (use max frame size for dynamic frame size support)
+static int allocate_buffers(t_opus_codec *codec) {
+    codec->input_buffer_left = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    codec->input_buffer_right = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    codec->output_buffer_left = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    codec->output_buffer_right = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    codec->interleaved_input = (float*)calloc(OPUS_MAX_FRAME_SIZE * OPUS_CHANNELS, sizeof(float));
+    codec->interleaved_output = (float*)calloc(OPUS_MAX_BUNDLE_SIZE * OPUS_CHANNELS, sizeof(float));
+    codec->opus_packet = (unsigned char*)calloc(OPUS_MAX_PACKET_SIZE, sizeof(unsigned char));
+    codec->bundle_packet = (unsigned char*)calloc(OPUS_MAX_BUNDLE_PACKET_SIZE, sizeof(unsigned char));
+    
+    // Allocate ring buffer (sized for the largest frame or bundle so any setting fits)
+    codec->output_ring_left = (float*)calloc(OPUS_RING_CAPACITY, sizeof(float));
+    codec->output_ring_right = (float*)calloc(OPUS_RING_CAPACITY, sizeof(float));
+    
+    // Check buffer allocation
+    if (!codec->input_buffer_left || !codec->input_buffer_right ||
+        !codec->output_buffer_left || !codec->output_buffer_right ||
+        !codec->interleaved_input || !codec->interleaved_output ||
+        !codec->opus_packet || !codec->bundle_packet ||
+        !codec->output_ring_left || !codec->output_ring_right) {
+        return OPUS_CODEC_ERROR;
+    }
+    
+    return OPUS_CODEC_OK;
+}
+
+#ifdef OPUS_CODEC_CUSTOM_MODES
+// Algorithmic delay of a custom mode: the MDCT overlap. Mirrors the short-MDCT
+// selection in libopus's opus_custom_mode_create, since the mode is opaque.
+static int custom_mode_delay(int sample_rate, int frame_size) {
+    int lm;
+    if (frame_size * 75 >= sample_rate && (frame_size % 16) == 0) lm = 3;
+    else if (frame_size * 150 >= sample_rate && (frame_size % 8) == 0) lm = 2;
+    else if (frame_size * 300 >= sample_rate && (frame_size % 4) == 0) lm = 1;
+    else lm = 0;
+    
+    return ((frame_size >> lm) >> 2) << 2;
+}
+#endif
+
+// Add an encoded frame to the current bundle. Returns the bundle size once
+// aggregate_frames frames are in bundle_packet, 0 while still collecting.
+static int bundle_frame(t_opus_codec *codec, unsigned char *packet, int packet_size) {
+    codec->stat_frames++;
+    codec->stat_frame_bytes += packet_size;
+    
+    int size = 0;
+    if (opus_repacketizer_cat(codec->repacketizer, packet, packet_size) != OPUS_OK) {
+        if (codec->bundle_count == 0) return 0;  // Unusable frame, nothing to ship
+        
+        // Encoder changed mode/bandwidth mid-bundle - ship what we have and
+        // restart the bundle with this frame in the first slot
+        size = opus_repacketizer_out_range(codec->repacketizer, 0,
+                                           opus_repacketizer_get_nb_frames(codec->repacketizer),
+                                           codec->bundle_packet, OPUS_MAX_BUNDLE_PACKET_SIZE);
+        opus_repacketizer_init(codec->repacketizer);
+        memmove(codec->frame_store, packet, packet_size);
+        opus_repacketizer_cat(codec->repacketizer, codec->frame_store, packet_size);
+        codec->bundle_count = 1;
+    } else if (++codec->bundle_count >= codec->aggregate_frames) {
+        size = opus_repacketizer_out_range(codec->repacketizer, 0,
+                                           opus_repacketizer_get_nb_frames(codec->repacketizer),
+                                           codec->bundle_packet, OPUS_MAX_BUNDLE_PACKET_SIZE);
+        opus_repacketizer_init(codec->repacketizer);
+        codec->bundle_count = 0;
+    }
+    
+    if (size <= 0) return 0;
+    
+    codec->bundle_size = size;
+    codec->stat_packets++;
+    codec->stat_packet_bytes += size;
+    return size;
+}
+
 t_opus_codec* opus_codec_create(int host_sample_rate) {
     t_opus_codec *codec = (t_opus_codec*)calloc(1, sizeof(t_opus_codec));
     if (!codec) return NULL;
@@ -17,6 +105,7 @@ t_opus_codec* opus_codec_create(int host_sample_rate) {
     int error;
     
     // Set sample rate to closest supported Opus rate
+    codec->host_sample_rate = host_sample_rate;
     codec->sample_rate = get_opus_sample_rate(host_sample_rate);
     
     // Initialize encoder with determined sample rate
@@ -45,6 +134,7 @@ t_opus_codec* opus_codec_create(int host_sample_rate) {
     codec->use_dtx = 0;      // Disable DTX by default
     codec->use_fec = 0;
     codec->frame_size = (int)(codec->sample_rate * OPUS_FRAME_SIZE_MS / 1000.0); // 20ms default
+    codec->aggregate_frames = 1;  // One frame per packet
     
     // Apply default settings to encoder
     opus_encoder_ctl(codec->encoder, OPUS_SET_BITRATE(codec->bitrate));
@@ -58,28 +148,11 @@ t_opus_codec* opus_codec_create(int host_sample_rate) {
     codec->silent_frames_count = 0;
     
     // Initialize ring buffer (4 frames worth, like MP3 codec)
-    codec->ring_size = codec->frame_size * 4;  // 4 frames for smooth output
+    codec->ring_size = codec->frame_size * (codec->aggregate_frames + 3);  // 4 frames for smooth output
     codec->ring_write_pos = 0;
     codec->ring_read_pos = 0;
     
-    // Allocate buffers (use max frame size for dynamic frame size support)
-    codec->input_buffer_left = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
-    codec->input_buffer_right = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
-    codec->output_buffer_left = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
-    codec->output_buffer_right = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
-    codec->interleaved_input = (float*)calloc(OPUS_MAX_FRAME_SIZE * OPUS_CHANNELS, sizeof(float));
-    codec->interleaved_output = (float*)calloc(OPUS_MAX_FRAME_SIZE * OPUS_CHANNELS, sizeof(float));
-    codec->opus_packet = (unsigned char*)calloc(OPUS_MAX_PACKET_SIZE, sizeof(unsigned char));
-    
-    // Allocate ring buffer
-    codec->output_ring_left = (float*)calloc(codec->ring_size, sizeof(float));
-    codec->output_ring_right = (float*)calloc(codec->ring_size, sizeof(float));
-    
-    // Check buffer allocation
-    if (!codec->input_buffer_left || !codec->input_buffer_right ||
-        !codec->output_buffer_left || !codec->output_buffer_right ||
-        !codec->interleaved_input || !codec->interleaved_output ||
-        !codec->opus_packet || !codec->output_ring_left || !codec->output_ring_right) {
+    if (allocate_buffers(codec) != OPUS_CODEC_OK) {
         opus_codec_destroy(codec);
         return NULL;
     }
@@ -91,11 +164,84 @@ t_opus_codec* opus_codec_create(int host_sample_rate) {
     return codec;
 }
 
+// Ultra-low-latency codec built on the Opus custom-mode API: runs natively at
+// the host rate with frame_size matched to the signal vector, so a whole
+// vector is encoded and decoded in one go via opus_codec_process_frame.
+// Returns NULL if libopus lacks custom modes or rejects the rate/frame size.
+t_opus_codec* opus_codec_create_custom(int host_sample_rate, int frame_size) {
+#ifdef OPUS_CODEC_CUSTOM_MODES
+    if (frame_size < OPUS_CUSTOM_MIN_FRAME_SIZE || frame_size > OPUS_CUSTOM_MAX_FRAME_SIZE) {
+        return NULL;
+    }
+    
+    t_opus_codec *codec = (t_opus_codec*)calloc(1, sizeof(t_opus_codec));
+    if (!codec) return NULL;
+    
+    int error;
+    
+    // No rate forcing - custom modes accept the host rate (e.g. 44.1kHz) directly
+    codec->custom = 1;
+    codec->host_sample_rate = host_sample_rate;
+    codec->sample_rate = host_sample_rate;
+    codec->frame_size = frame_size;
+    
+    codec->custom_mode = opus_custom_mode_create(host_sample_rate, frame_size, &error);
+    if (error != OPUS_OK || !codec->custom_mode) {
+        opus_codec_destroy(codec);
+        return NULL;
+    }
+    
+    codec->custom_encoder = opus_custom_encoder_create(codec->custom_mode, OPUS_CHANNELS, &error);
+    if (error != OPUS_OK || !codec->custom_encoder) {
+        opus_codec_destroy(codec);
+        return NULL;
+    }
+    
+    codec->custom_decoder = opus_custom_decoder_create(codec->custom_mode, OPUS_CHANNELS, &error);
+    if (error != OPUS_OK || !codec->custom_decoder) {
+        opus_codec_destroy(codec);
+        return NULL;
+    }
+    
+    // Same defaults as opus_codec_create; signal/DTX/FEC do not apply to custom modes
+    codec->bitrate = 6000;
+    codec->complexity = 0;
+    codec->vbr_mode = 0;
+    codec->signal_type = OPUS_SIGNAL_MUSIC;
+    codec->application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+    codec->custom_delay = custom_mode_delay(host_sample_rate, frame_size);
+    codec->aggregate_frames = 1;  // Custom packets cannot be repacketized
+    
+    opus_custom_encoder_ctl(codec->custom_encoder, OPUS_SET_BITRATE(codec->bitrate));
+    opus_custom_encoder_ctl(codec->custom_encoder, OPUS_SET_COMPLEXITY(codec->complexity));
+    opus_custom_encoder_ctl(codec->custom_encoder, OPUS_SET_VBR(codec->vbr_mode));
+    
+    codec->silence_threshold = 0.001f;
+    codec->ring_size = frame_size * 4;  // Unused by custom frames, kept consistent
+    
+    if (allocate_buffers(codec) != OPUS_CODEC_OK) {
+        opus_codec_destroy(codec);
+        return NULL;
+    }
+    
+    return codec;
+#else
+    (void)host_sample_rate;
+    (void)frame_size;
+    return NULL;
+#endif
+}
+
 void opus_codec_destroy(t_opus_codec *codec) {
     if (!codec) return;
     
     if (codec->encoder) opus_encoder_destroy(codec->encoder);
     if (codec->decoder) opus_decoder_destroy(codec->decoder);
+#ifdef OPUS_CODEC_CUSTOM_MODES
+    if (codec->custom_encoder) opus_custom_encoder_destroy(codec->custom_encoder);
+    if (codec->custom_decoder) opus_custom_decoder_destroy(codec->custom_decoder);
+    if (codec->custom_mode) opus_custom_mode_destroy(codec->custom_mode);
+#endif
     
     free(codec->input_buffer_left);
     free(codec->input_buffer_right);
@@ -104,6 +250,9 @@ void opus_codec_destroy(t_opus_codec *codec) {
     free(codec->interleaved_input);
     free(codec->interleaved_output);
     free(codec->opus_packet);
+    free(codec->bundle_packet);
+    free(codec->frame_store);
+    if (codec->repacketizer) opus_repacketizer_destroy(codec->repacketizer);
     free(codec->output_ring_left);
     free(codec->output_ring_right);
     
@@ -114,6 +263,23 @@ int opus_codec_process_sample(t_opus_codec *codec, float in_left, float in_right
                               float *out_left, float *out_right) {
     if (!codec || !out_left || !out_right) return OPUS_CODEC_ERROR;
     
+    // Custom modes have no ring hold: emit the previous frame's output sample by
+    // sample (one frame of delay). Vector-sized blocks should use process_frame.
+    if (codec->custom) {
+        codec->input_buffer_left[codec->buffer_pos] = in_left;
+        codec->input_buffer_right[codec->buffer_pos] = in_right;
+        *out_left = codec->output_buffer_left[codec->buffer_pos];
+        *out_right = codec->output_buffer_right[codec->buffer_pos];
+        codec->buffer_pos++;
+        
+        if (codec->buffer_pos >= codec->frame_size) {
+            codec->buffer_pos = 0;
+            return opus_codec_process_frame(codec, codec->input_buffer_left, codec->input_buffer_right,
+                                            codec->output_buffer_left, codec->output_buffer_right);
+        }
+        return OPUS_CODEC_OK;
+    }
+    
     // Add input to frame buffer
     codec->input_buffer_left[codec->buffer_pos] = in_left;
     codec->input_buffer_right[codec->buffer_pos] = in_right;
@@ -129,20 +295,35 @@ int opus_codec_process_sample(t_opus_codec *codec, float in_left, float in_right
             codec->interleaved_input[i * 2 + 1] = codec->input_buffer_right[i];
         }
         
-        // Encode the frame
+        // Encode the frame (into its bundle slot when aggregating, since the
+        // repacketizer references frame data until the bundle is written out)
+        int aggregating = codec->aggregate_frames > 1;
+        unsigned char *packet = aggregating ?
+            codec->frame_store + codec->bundle_count * OPUS_MAX_PACKET_SIZE : codec->opus_packet;
+        
         int packet_size = opus_encode_float(codec->encoder, 
                                             codec->interleaved_input,
                                             codec->frame_size,
-                                            codec->opus_packet,
+                                            packet,
                                             OPUS_MAX_PACKET_SIZE);
         
+        if (packet_size > 0 && aggregating) {
+            packet_size = bundle_frame(codec, packet, packet_size);
+            packet = codec->bundle_packet;
+        } else if (packet_size > 0) {
+            codec->stat_frames++;
+            codec->stat_packets++;
+            codec->stat_frame_bytes += packet_size;
+            codec->stat_packet_bytes += packet_size;
+        }
+        
         if (packet_size > 0) {
-            // Decode the packet immediately
+            // Decode the packet (or every frame of a bundle) immediately
             int decoded_samples = opus_decode_float(codec->decoder,
-                                                    codec->opus_packet,
+                                                    packet,
                                                     packet_size,
                                                     codec->interleaved_output,
-                                                    codec->frame_size,
+                                                    OPUS_MAX_BUNDLE_SIZE,
                                                     0);
             
             if (decoded_samples > 0) {
@@ -184,12 +365,56 @@ int opus_codec_process_sample(t_opus_codec *codec, float in_left, float in_right
     return OPUS_CODEC_OK;
 }
 
+// Encode and decode exactly one custom-mode frame (frame_size samples) with no
+// buffering. Input and output may alias the codec's own frame buffers.
+int opus_codec_process_frame(t_opus_codec *codec, const float *in_left, const float *in_right,
+                             float *out_left, float *out_right) {
+    if (!codec || !codec->custom) return OPUS_CODEC_ERROR;
+    
+#ifdef OPUS_CODEC_CUSTOM_MODES
+    for (int i = 0; i < codec->frame_size; i++) {
+        codec->interleaved_input[i * 2] = in_left[i];
+        codec->interleaved_input[i * 2 + 1] = in_right[i];
+    }
+    
+    int packet_size = opus_custom_encode_float(codec->custom_encoder,
+                                               codec->interleaved_input,
+                                               codec->frame_size,
+                                               codec->opus_packet,
+                                               OPUS_MAX_PACKET_SIZE);
+    
+    int decoded_samples = 0;
+    if (packet_size > 0) {
+        decoded_samples = opus_custom_decode_float(codec->custom_decoder,
+                                                   codec->opus_packet,
+                                                   packet_size,
+                                                   codec->interleaved_output,
+                                                   codec->frame_size);
+    }
+    
+    if (decoded_samples == codec->frame_size) {
+        for (int i = 0; i < codec->frame_size; i++) {
+            out_left[i] = codec->interleaved_output[i * 2];
+            out_right[i] = codec->interleaved_output[i * 2 + 1];
+        }
+        return OPUS_CODEC_OK;
+    }
+#else
+    (void)in_left;
+    (void)in_right;
+#endif
+    
+    memset(out_left, 0, codec->frame_size * sizeof(float));
+    memset(out_right, 0, codec->frame_size * sizeof(float));
+    return OPUS_CODEC_ERROR;
+}
+
 // Parameter setters
 int opus_codec_set_bitrate(t_opus_codec *codec, int bitrate) {
     if (!codec || bitrate < 6000 || bitrate > 510000) return OPUS_CODEC_ERROR;
     
     codec->bitrate = bitrate;
-    return opus_encoder_ctl(codec->encoder, OPUS_SET_BITRATE(bitrate)) == OPUS_OK ? 
+    return CODEC_ENCODER_CTL(codec, OPUS_SET_BITRATE(bitrate)) == OPUS_OK ? 
            OPUS_CODEC_OK : OPUS_CODEC_ERROR;
 }
 
@@ -197,7 +422,7 @@ int opus_codec_set_complexity(t_opus_codec *codec, int complexity) {
     if (!codec || complexity < 0 || complexity > 10) return OPUS_CODEC_ERROR;
     
     codec->complexity = complexity;
-    return opus_encoder_ctl(codec->encoder, OPUS_SET_COMPLEXITY(complexity)) == OPUS_OK ?
+    return CODEC_ENCODER_CTL(codec, OPUS_SET_COMPLEXITY(complexity)) == OPUS_OK ?
            OPUS_CODEC_OK : OPUS_CODEC_ERROR;
 }
 
@@ -209,18 +434,18 @@ int opus_codec_set_vbr_mode(t_opus_codec *codec, int mode) {
     
     switch (mode) {
         case 0:  // CBR
-            result = opus_encoder_ctl(codec->encoder, OPUS_SET_VBR(0));
+            result = CODEC_ENCODER_CTL(codec, OPUS_SET_VBR(0));
             break;
         case 1:  // VBR
-            result = opus_encoder_ctl(codec->encoder, OPUS_SET_VBR(1));
+            result = CODEC_ENCODER_CTL(codec, OPUS_SET_VBR(1));
             if (result == OPUS_OK) {
-                result = opus_encoder_ctl(codec->encoder, OPUS_SET_VBR_CONSTRAINT(0));
+                result = CODEC_ENCODER_CTL(codec, OPUS_SET_VBR_CONSTRAINT(0));
             }
             break;
         case 2:  // CVBR
-            result = opus_encoder_ctl(codec->encoder, OPUS_SET_VBR(1));
+            result = CODEC_ENCODER_CTL(codec, OPUS_SET_VBR(1));
             if (result == OPUS_OK) {
-                result = opus_encoder_ctl(codec->encoder, OPUS_SET_VBR_CONSTRAINT(1));
+                result = CODEC_ENCODER_CTL(codec, OPUS_SET_VBR_CONSTRAINT(1));
             }
             break;
         default:
@@ -236,6 +461,7 @@ int opus_codec_set_signal_type(t_opus_codec *codec, int type) {
     }
     
     codec->signal_type = type;
+    if (codec->custom) return OPUS_CODEC_OK;  // CELT-only, no signal hint
     return opus_encoder_ctl(codec->encoder, OPUS_SET_SIGNAL(type)) == OPUS_OK ?
            OPUS_CODEC_OK : OPUS_CODEC_ERROR;
 }
@@ -244,7 +470,7 @@ int opus_codec_set_packet_loss(t_opus_codec *codec, int percentage) {
     if (!codec || percentage < 0 || percentage > 100) return OPUS_CODEC_ERROR;
     
     codec->packet_loss_perc = percentage;
-    return opus_encoder_ctl(codec->encoder, OPUS_SET_PACKET_LOSS_PERC(percentage)) == OPUS_OK ?
+    return CODEC_ENCODER_CTL(codec, OPUS_SET_PACKET_LOSS_PERC(percentage)) == OPUS_OK ?
            OPUS_CODEC_OK : OPUS_CODEC_ERROR;
 }
 
@@ -252,6 +478,7 @@ int opus_codec_set_dtx(t_opus_codec *codec, int enable) {
     if (!codec) return OPUS_CODEC_ERROR;
     
     codec->use_dtx = enable ? 1 : 0;
+    if (codec->custom) return OPUS_CODEC_OK;  // Not supported by custom modes
     return opus_encoder_ctl(codec->encoder, OPUS_SET_DTX(codec->use_dtx)) == OPUS_OK ?
            OPUS_CODEC_OK : OPUS_CODEC_ERROR;
 }
@@ -260,6 +487,7 @@ int opus_codec_set_fec(t_opus_codec *codec, int enable) {
     if (!codec) return OPUS_CODEC_ERROR;
     
     codec->use_fec = enable ? 1 : 0;
+    if (codec->custom) return OPUS_CODEC_OK;  // Not supported by custom modes
     return opus_encoder_ctl(codec->encoder, OPUS_SET_INBAND_FEC(codec->use_fec)) == OPUS_OK ?
            OPUS_CODEC_OK : OPUS_CODEC_ERROR;
 }
@@ -268,8 +496,17 @@ int opus_codec_reset(t_opus_codec *codec) {
     if (!codec) return OPUS_CODEC_ERROR;
     
     // Reset encoder and decoder states
-    int enc_result = opus_encoder_ctl(codec->encoder, OPUS_RESET_STATE);
-    int dec_result = opus_decoder_ctl(codec->decoder, OPUS_RESET_STATE);
+    int enc_result, dec_result;
+#ifdef OPUS_CODEC_CUSTOM_MODES
+    if (codec->custom) {
+        enc_result = opus_custom_encoder_ctl(codec->custom_encoder, OPUS_RESET_STATE);
+        dec_result = opus_custom_decoder_ctl(codec->custom_decoder, OPUS_RESET_STATE);
+    } else
+#endif
+    {
+        enc_result = opus_encoder_ctl(codec->encoder, OPUS_RESET_STATE);
+        dec_result = opus_decoder_ctl(codec->decoder, OPUS_RESET_STATE);
+    }
     
     // Clear buffers
     memset(codec->input_buffer_left, 0, OPUS_MAX_FRAME_SIZE * sizeof(float));
@@ -277,7 +514,17 @@ int opus_codec_reset(t_opus_codec *codec) {
     memset(codec->output_buffer_left, 0, OPUS_MAX_FRAME_SIZE * sizeof(float));
     memset(codec->output_buffer_right, 0, OPUS_MAX_FRAME_SIZE * sizeof(float));
     memset(codec->interleaved_input, 0, OPUS_MAX_FRAME_SIZE * OPUS_CHANNELS * sizeof(float));
-    memset(codec->interleaved_output, 0, OPUS_MAX_FRAME_SIZE * OPUS_CHANNELS * sizeof(float));
+    memset(codec->interleaved_output, 0, OPUS_MAX_BUNDLE_SIZE * OPUS_CHANNELS * sizeof(float));
+    
+    // Drop any partially collected bundle
+    if (codec->repacketizer) opus_repacketizer_init(codec->repacketizer);
+    codec->bundle_count = 0;
+    
+    // Restart the ring buffer so output timing matches a fresh codec
+    memset(codec->output_ring_left, 0, OPUS_RING_CAPACITY * sizeof(float));
+    memset(codec->output_ring_right, 0, OPUS_RING_CAPACITY * sizeof(float));
+    codec->ring_write_pos = 0;
+    codec->ring_read_pos = 0;
     
     codec->buffer_pos = 0;
     codec->output_pos = 0;
@@ -290,18 +537,68 @@ int opus_codec_reset(t_opus_codec *codec) {
 int opus_codec_get_latency(t_opus_codec *codec) {
     if (!codec) return -1;
     
+    // Custom frames are coded in place per signal vector, so only the MDCT
+    // overlap remains - plus one frame while fed sample by sample (e.g. an old
+    // instance running at a new vector size until its replacement swaps in)
+    if (codec->custom) return codec->custom_delay + (codec->custom_per_sample ? codec->frame_size : 0);
+    
     opus_int32 lookahead;
     opus_encoder_ctl(codec->encoder, OPUS_GET_LOOKAHEAD(&lookahead));
     
-    // Total latency = encoder lookahead + frame size + decoder delay
-    // Decoder has a fixed delay of 6.5ms (scaled by sample rate)
-    int decoder_delay = (int)(codec->sample_rate * 6.5 / 1000.0);
-    return lookahead + codec->frame_size + decoder_delay;
+    // Total latency = encoder lookahead (the codec's full algorithmic delay)
+    // + frame/bundle collection + one frame held in the ring buffer. The last
+    // sample of a frame is decoded as soon as it arrives, hence the -1.
+    return lookahead + codec->frame_size + opus_codec_get_aggregation_latency(codec) +
+           codec->frame_size - 1;
 }
 
-// Frame size configuration (must be called when no audio is being processed)
+// Bundle consecutive frames into one packet (must be called when no audio is
+// being processed, after the frame size is set). Total duration is capped at 120ms.
+int opus_codec_set_aggregation(t_opus_codec *codec, int frames) {
+    if (!codec || codec->custom || frames < 1 || frames > OPUS_MAX_BUNDLE_FRAMES) return OPUS_CODEC_ERROR;
+    if (frames * codec->frame_size > codec->sample_rate * 120 / 1000) return OPUS_CODEC_ERROR;
+    
+    if (frames > 1) {
+        if (!codec->repacketizer) codec->repacketizer = opus_repacketizer_create();
+        
+        unsigned char *store = (unsigned char*)realloc(codec->frame_store, frames * OPUS_MAX_PACKET_SIZE);
+        if (!codec->repacketizer || !store) return OPUS_CODEC_ERROR;
+        codec->frame_store = store;
+        
+        opus_repacketizer_init(codec->repacketizer);
+    }
+    
+    codec->aggregate_frames = frames;
+    codec->bundle_count = 0;
+    
+    // Resize ring buffer to hold a whole bundle on top of the usual 3 frames
+    codec->ring_size = codec->frame_size * (frames + 3);
+    codec->ring_write_pos = 0;
+    codec->ring_read_pos = 0;
+    
+    return OPUS_CODEC_OK;
+}
+
+// Extra delay from waiting for a bundle to fill, in samples
+int opus_codec_get_aggregation_latency(t_opus_codec *codec) {
+    if (!codec) return 0;
+    return (codec->aggregate_frames - 1) * codec->frame_size;
+}
+
+// Bytes saved by aggregation so far, counting per_packet_overhead transport
+// header bytes for every packet
+long long opus_codec_get_bytes_saved(t_opus_codec *codec, int per_packet_overhead) {
+    if (!codec) return 0;
+    
+    long long unbundled = codec->stat_frame_bytes + codec->stat_frames * per_packet_overhead;
+    long long bundled = codec->stat_packet_bytes + codec->stat_packets * per_packet_overhead;
+    return unbundled - bundled;
+}
+
+// Frame size configuration (must be called when no audio is being processed;
+// live changes should build a new instance and go through opus_codec_swap_submit)
 int opus_codec_set_frame_size_ms(t_opus_codec *codec, float ms) {
-    if (!codec) return OPUS_CODEC_ERROR;
+    if (!codec || codec->custom) return OPUS_CODEC_ERROR;  // Custom frame size is fixed by its mode
     
     // Valid frame sizes: 2.5, 5, 10, 20, 40, 60 ms
     // Calculate samples based on current sample rate
@@ -319,5 +616,695 @@ int opus_codec_set_frame_size_ms(t_opus_codec *codec, float ms) {
     codec->output_pos = 0;
     codec->output_available = 0;
     
+    // Resize ring buffer to 4 frames of the new size (plus any bundle)
+    codec->ring_size = samples * (codec->aggregate_frames + 3);
+    codec->ring_write_pos = 0;
+    codec->ring_read_pos = 0;
+    memset(codec->output_ring_left, 0, OPUS_RING_CAPACITY * sizeof(float));
+    memset(codec->output_ring_right, 0, OPUS_RING_CAPACITY * sizeof(float));
+    
+    return OPUS_CODEC_OK;
+}
+
+// Feed input through the codec and discard the output, so a fresh instance
+// reaches steady state before it is heard
+int opus_codec_preroll(t_opus_codec *codec, const float *left, const float *right, int count) {
+    if (!codec || (count > 0 && (!left || !right))) return OPUS_CODEC_ERROR;
+    
+    // Custom codecs take whole frames so they stay aligned to the signal vector;
+    // drop the oldest partial frame
+    if (codec->custom) {
+        for (int i = count % codec->frame_size; i < count; i += codec->frame_size) {
+            opus_codec_process_frame(codec, left + i, right + i,
+                                     codec->output_buffer_left, codec->output_buffer_right);
+        }
+        return OPUS_CODEC_OK;
+    }
+    
+    float discard_left, discard_right;
+    for (int i = 0; i < count; i++) {
+        opus_codec_process_sample(codec, left[i], right[i], &discard_left, &discard_right);
+    }
+    
+    return OPUS_CODEC_OK;
+}
+
+// Run a block through one codec: custom codecs code a vector-sized block in
+// place, everything else goes sample by sample
+static int process_block(t_opus_codec *codec, const float *in_left, const float *in_right,
+                         float *out_left, float *out_right, int count) {
+    if (codec->custom && count == codec->frame_size && codec->buffer_pos == 0) {
+        codec->custom_per_sample = 0;
+        return opus_codec_process_frame(codec, in_left, in_right, out_left, out_right);
+    }
+    if (codec->custom) codec->custom_per_sample = 1;
+    
+    int result = OPUS_CODEC_OK;
+    for (int i = 0; i < count; i++) {
+        if (opus_codec_process_sample(codec, in_left[i], in_right[i],
+                                      &out_left[i], &out_right[i]) != OPUS_CODEC_OK) {
+            result = OPUS_CODEC_ERROR;
+        }
+    }
+    return result;
+}
+
+// Reconfiguration via background build and atomic swap
+t_opus_codec_swap* opus_codec_swap_create(void) {
+    t_opus_codec_swap *swap = (t_opus_codec_swap*)calloc(1, sizeof(t_opus_codec_swap));
+    if (!swap) return NULL;
+    
+    atomic_init(&swap->active, NULL);
+    atomic_init(&swap->pending, NULL);
+    atomic_init(&swap->retired, NULL);
+    atomic_init(&swap->in_flight, 0);
+    atomic_init(&swap->history_count, 0);
+    
+    swap->history_left = (float*)calloc(OPUS_HISTORY_SIZE, sizeof(float));
+    swap->history_right = (float*)calloc(OPUS_HISTORY_SIZE, sizeof(float));
+    swap->fade_left = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    swap->fade_right = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    
+    if (!swap->history_left || !swap->history_right || !swap->fade_left || !swap->fade_right) {
+        opus_codec_swap_destroy(swap);
+        return NULL;
+    }
+    
+    return swap;
+}
+
+// Must only be called once the audio thread no longer uses the swap
+void opus_codec_swap_destroy(t_opus_codec_swap *swap) {
+    if (!swap) return;
+    
+    opus_codec_destroy(atomic_load(&swap->active));
+    opus_codec_destroy(atomic_load(&swap->pending));
+    opus_codec_destroy(atomic_load(&swap->retired));
+    opus_codec_destroy(swap->incoming);
+    opus_codec_destroy(swap->fading);
+    
+    free(swap->history_left);
+    free(swap->history_right);
+    free(swap->fade_left);
+    free(swap->fade_right);
+    
+    free(swap);
+}
+
+// Pre-roll a fully configured instance with recent input and queue it for the
+// audio thread. Takes ownership of codec. Call off the audio thread.
+int opus_codec_swap_submit(t_opus_codec_swap *swap, t_opus_codec *codec) {
+    if (!swap || !codec) return OPUS_CODEC_ERROR;
+    
+    // Snapshot the newest history, leaving one max frame of headroom so the
+    // audio thread can keep writing while we copy
+    long long end = atomic_load_explicit(&swap->history_count, memory_order_acquire);
+    long long count = end;
+    if (count > OPUS_HISTORY_SIZE - OPUS_MAX_FRAME_SIZE) {
+        count = OPUS_HISTORY_SIZE - OPUS_MAX_FRAME_SIZE;
+    }
+    
+    if (count > 0) {
+        float *left = (float*)malloc(count * sizeof(float));
+        float *right = (float*)malloc(count * sizeof(float));
+        
+        if (left && right) {
+            for (long long i = 0; i < count; i++) {
+                int idx = (int)((end - count + i) % OPUS_HISTORY_SIZE);
+                left[i] = swap->history_left[idx];
+                right[i] = swap->history_right[idx];
+            }
+            opus_codec_preroll(codec, left, right, (int)count);
+        }
+        
+        free(left);
+        free(right);
+    }
+    codec->history_pos = end;
+    
+    // Replace any instance the audio thread has not picked up yet
+    atomic_fetch_add(&swap->in_flight, 1);
+    t_opus_codec *stale = atomic_exchange(&swap->pending, codec);
+    if (stale) {
+        atomic_fetch_sub(&swap->in_flight, 1);
+        opus_codec_destroy(stale);
+    }
+    
+    opus_codec_swap_collect(swap);
+    return OPUS_CODEC_OK;
+}
+
+// Free an instance retired by the audio thread. Call off the audio thread.
+void opus_codec_swap_collect(t_opus_codec_swap *swap) {
+    if (!swap) return;
+    
+    t_opus_codec *old = atomic_exchange(&swap->retired, NULL);
+    opus_codec_destroy(old);
+}
+
+t_opus_codec* opus_codec_swap_get_active(t_opus_codec_swap *swap) {
+    if (!swap) return NULL;
+    return atomic_load_explicit(&swap->active, memory_order_acquire);
+}
+
+// True while a submitted instance is pending or catching up. Its settings
+// were fixed at build time, so changes made to the active codec miss it.
+int opus_codec_swap_has_pending(t_opus_codec_swap *swap) {
+    if (!swap) return 0;
+    return atomic_load_explicit(&swap->in_flight, memory_order_acquire) > 0;
+}
+
+// Audio thread: make the incoming instance active, crossfading from the
+// previous one if there is one
+static void swap_activate(t_opus_codec_swap *swap) {
+    t_opus_codec *next = swap->incoming;
+    
+    // Pre-roll and catch-up frames were never sent; count from activation
+    next->stat_frames = 0;
+    next->stat_packets = 0;
+    next->stat_frame_bytes = 0;
+    next->stat_packet_bytes = 0;
+    
+    t_opus_codec *prev = atomic_load_explicit(&swap->active, memory_order_relaxed);
+    if (prev) {
+        swap->fading = prev;
+        swap->fade_pos = 0;
+        swap->fade_len = (int)(next->host_sample_rate * OPUS_SWAP_FADE_MS / 1000.0);
+        if (swap->fade_len < 1) swap->fade_len = 1;
+    }
+    
+    swap->incoming = NULL;
+    atomic_store_explicit(&swap->active, next, memory_order_release);
+    atomic_fetch_sub_explicit(&swap->in_flight, 1, memory_order_release);
+}
+
+// Audio thread, once per vector: retire a faded-out instance and pick up a
+// pending one. Returns 1 when an instance is waiting for opus_codec_swap_collect.
+int opus_codec_swap_poll(t_opus_codec_swap *swap) {
+    if (!swap) return 0;
+    
+    int retired = 0;
+    
+    // Hand the faded-out instance over for reclamation once the slot is free
+    if (swap->fading && swap->fade_pos >= swap->fade_len) {
+        t_opus_codec *expected = NULL;
+        if (atomic_compare_exchange_strong(&swap->retired, &expected, swap->fading)) {
+            swap->fading = NULL;
+            retired = 1;
+        }
+    }
+    
+    // Only one swap in flight at a time
+    if (swap->fading || swap->incoming) return retired;
+    
+    swap->incoming = atomic_exchange_explicit(&swap->pending, NULL, memory_order_acquire);
+    
+    // Nothing to fade from or catch up with: the first instance starts at once
+    if (swap->incoming && !atomic_load_explicit(&swap->active, memory_order_relaxed)) {
+        swap_activate(swap);
+    }
+    return retired;
+}
+
+// Audio thread: feed the incoming instance the input that arrived after its
+// pre-roll snapshot, then make it active. The work per call is bounded to the
+// new block plus OPUS_SWAP_CATCHUP_FRAMES frames, so a long backlog is spread
+// over several vectors instead of landing in one.
+static void swap_catch_up(t_opus_codec_swap *swap, long long now, int count) {
+    t_opus_codec *next = swap->incoming;
+    int frame = next->frame_size;
+    
+    if (next->history_pos < now - OPUS_HISTORY_SIZE) next->history_pos = now - OPUS_HISTORY_SIZE;
+    
+    long long end = next->history_pos + count + OPUS_SWAP_CATCHUP_FRAMES * frame;
+    if (end > now) end = now;
+    
+    if (next->custom) {
+        // Whole frames only, staged through the codec's input buffers; drop a
+        // leading partial frame so the last one ends on 'now'
+        next->history_pos += (now - next->history_pos) % frame;
+        
+        for (; next->history_pos + frame <= end; next->history_pos += frame) {
+            for (int i = 0; i < frame; i++) {
+                int idx = (int)((next->history_pos + i) % OPUS_HISTORY_SIZE);
+                next->input_buffer_left[i] = swap->history_left[idx];
+                next->input_buffer_right[i] = swap->history_right[idx];
+            }
+            opus_codec_process_frame(next, next->input_buffer_left, next->input_buffer_right,
+                                     next->output_buffer_left, next->output_buffer_right);
+        }
+    } else {
+        float discard_left, discard_right;
+        for (; next->history_pos < end; next->history_pos++) {
+            int idx = (int)(next->history_pos % OPUS_HISTORY_SIZE);
+            opus_codec_process_sample(next, swap->history_left[idx], swap->history_right[idx],
+                                      &discard_left, &discard_right);
+        }
+    }
+    
+    if (next->history_pos < now) return;
+    
+    swap_activate(swap);
+}
+
+// Audio thread: record input history and run the active instance over a block,
+// crossfading from the previous one right after a swap
+int opus_codec_swap_process_block(t_opus_codec_swap *swap, const float *in_left, const float *in_right,
+                                  float *out_left, float *out_right, int count) {
+    if (!swap || !in_left || !in_right || !out_left || !out_right) return OPUS_CODEC_ERROR;
+    
+    long long pos = atomic_load_explicit(&swap->history_count, memory_order_relaxed);
+    
+    // Bring a newly picked-up instance up to date; it goes active once caught up
+    if (swap->incoming) swap_catch_up(swap, pos, count);
+    
+    for (int i = 0; i < count; i++) {
+        int idx = (int)((pos + i) % OPUS_HISTORY_SIZE);
+        swap->history_left[idx] = in_left[i];
+        swap->history_right[idx] = in_right[i];
+    }
+    atomic_store_explicit(&swap->history_count, pos + count, memory_order_release);
+    
+    t_opus_codec *active = atomic_load_explicit(&swap->active, memory_order_relaxed);
+    if (!active) {
+        memset(out_left, 0, count * sizeof(float));
+        memset(out_right, 0, count * sizeof(float));
+        return OPUS_CODEC_ERROR;
+    }
+    
+    int result = process_block(active, in_left, in_right, out_left, out_right, count);
+    
+    // Fade through the scratch buffers in chunks they can hold
+    for (int offset = 0; offset < count && swap->fading && swap->fade_pos < swap->fade_len; ) {
+        int chunk = count - offset;
+        if (chunk > OPUS_MAX_FRAME_SIZE) chunk = OPUS_MAX_FRAME_SIZE;
+        
+        process_block(swap->fading, in_left + offset, in_right + offset,
+                      swap->fade_left, swap->fade_right, chunk);
+        
+        for (int i = 0; i < chunk && swap->fade_pos < swap->fade_len; i++) {
+            float gain = (float)swap->fade_pos / (float)swap->fade_len;
+            float *left = &out_left[offset + i];
+            float *right = &out_right[offset + i];
+            *left = swap->fade_left[i] + (*left - swap->fade_left[i]) * gain;
+            *right = swap->fade_right[i] + (*right - swap->fade_right[i]) * gain;
+            swap->fade_pos++;
+        }
+        offset += chunk;
+    }
+    
+    return result;
+}
+
+// Quality metering: compares a delay-aligned copy of the input with the decoded
+// output in OPUS_QUALITY_FFT_SIZE frames
+t_opus_quality* opus_quality_create(void) {
+    t_opus_quality *quality = (t_opus_quality*)calloc(1, sizeof(t_opus_quality));
+    if (!quality) return NULL;
+    
+    int n = OPUS_QUALITY_FFT_SIZE;
+    atomic_init(&quality->reset_requested, 0);
+    
+    quality->delay_left = (float*)calloc(OPUS_QUALITY_MAX_DELAY, sizeof(float));
+    quality->delay_right = (float*)calloc(OPUS_QUALITY_MAX_DELAY, sizeof(float));
+    quality->ref_left = (float*)calloc(n, sizeof(float));
+    quality->ref_right = (float*)calloc(n, sizeof(float));
+    quality->deg_left = (float*)calloc(n, sizeof(float));
+    quality->deg_right = (float*)calloc(n, sizeof(float));
+    quality->fft_re = (float*)calloc(n, sizeof(float));
+    quality->fft_im = (float*)calloc(n, sizeof(float));
+    quality->window = (float*)calloc(n, sizeof(float));
+    quality->twiddle_re = (float*)calloc(n, sizeof(float));
+    quality->twiddle_im = (float*)calloc(n, sizeof(float));
+    quality->bitrev = (int*)calloc(n, sizeof(int));
+    
+    if (!quality->delay_left || !quality->delay_right ||
+        !quality->ref_left || !quality->ref_right || !quality->deg_left || !quality->deg_right ||
+        !quality->fft_re || !quality->fft_im || !quality->window ||
+        !quality->twiddle_re || !quality->twiddle_im || !quality->bitrev) {
+        opus_quality_destroy(quality);
+        return NULL;
+    }
+    
+    // Hann window
+    for (int i = 0; i < n; i++) {
+        quality->window[i] = (float)(0.5 - 0.5 * cos(2.0 * M_PI * i / n));
+    }
+    
+    // Bit-reversed indices
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        }
+        quality->bitrev[i] = r;
+    }
+    
+    // Twiddles stored stage by stage (stage with half-size h at offset h - 1),
+    // so each butterfly loop reads contiguous memory and vectorizes
+    for (int half = 1; half < n; half <<= 1) {
+        for (int k = 0; k < half; k++) {
+            double angle = -M_PI * k / half;
+            quality->twiddle_re[half - 1 + k] = (float)cos(angle);
+            quality->twiddle_im[half - 1 + k] = (float)sin(angle);
+        }
+    }
+    
+    quality->delay = -1;
+    return quality;
+}
+
+void opus_quality_destroy(t_opus_quality *quality) {
+    if (!quality) return;
+    
+    free(quality->delay_left);
+    free(quality->delay_right);
+    free(quality->ref_left);
+    free(quality->ref_right);
+    free(quality->deg_left);
+    free(quality->deg_right);
+    free(quality->fft_re);
+    free(quality->fft_im);
+    free(quality->window);
+    free(quality->twiddle_re);
+    free(quality->twiddle_im);
+    free(quality->bitrev);
+    
+    free(quality);
+}
+
+// Clear running averages and restart alignment
+void opus_quality_reset(t_opus_quality *quality) {
+    if (!quality) return;
+    
+    memset(quality->delay_left, 0, OPUS_QUALITY_MAX_DELAY * sizeof(float));
+    memset(quality->delay_right, 0, OPUS_QUALITY_MAX_DELAY * sizeof(float));
+    quality->delay = -1;
+    quality->delay_pos = 0;
+    quality->written = 0;
+    quality->frame_pos = 0;
+    quality->frames = 0;
+    quality->snr_sum = 0.0;
+    quality->lsd_sum = 0.0;
+    quality->segmental_snr = 0.0;
+    quality->log_spectral_distance = 0.0;
+}
+
+// Any thread: have the next opus_quality_process call start from scratch.
+// opus_quality_reset itself must not race the audio thread.
+void opus_quality_request_reset(t_opus_quality *quality) {
+    if (!quality) return;
+    atomic_store_explicit(&quality->reset_requested, 1, memory_order_release);
+}
+
+// One group of radix-2 butterflies. The a/b halves, the re/im arrays and
+// the twiddle tables never overlap; restrict on the parameters lets the
+// loop vectorize without run-time alias checks.
+static void quality_butterflies(float *restrict a_re, float *restrict a_im,
+                                float *restrict b_re, float *restrict b_im,
+                                const float *restrict w_re, const float *restrict w_im, int half) {
+    for (int k = 0; k < half; k++) {
+        float t_re = b_re[k] * w_re[k] - b_im[k] * w_im[k];
+        float t_im = b_re[k] * w_im[k] + b_im[k] * w_re[k];
+        b_re[k] = a_re[k] - t_re;
+        b_im[k] = a_im[k] - t_im;
+        a_re[k] += t_re;
+        a_im[k] += t_im;
+    }
+}
+
+// In-place radix-2 FFT over fft_re/fft_im
+static void quality_fft(t_opus_quality *quality) {
+    int n = OPUS_QUALITY_FFT_SIZE;
+    float *re = quality->fft_re;
+    float *im = quality->fft_im;
+    
+    for (int i = 0; i < n; i++) {
+        int j = quality->bitrev[i];
+        if (j > i) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    
+    for (int half = 1; half < n; half <<= 1) {
+        const float *w_re = quality->twiddle_re + half - 1;
+        const float *w_im = quality->twiddle_im + half - 1;
+        
+        for (int start = 0; start < n; start += half * 2) {
+            quality_butterflies(re + start, im + start, re + start + half, im + start + half,
+                                w_re, w_im, half);
+        }
+    }
+}
+
+// Bin powers of the two real signals packed into the last FFT:
+// R[k] = (Z[k] + conj(Z[n-k])) / 2, D[k] = (Z[k] - conj(Z[n-k])) / 2i
+static void quality_split_bin(const t_opus_quality *quality, int k, double *ref_power, double *deg_power) {
+    int n = OPUS_QUALITY_FFT_SIZE;
+    float a = quality->fft_re[k], b = quality->fft_im[k];
+    float c = quality->fft_re[n - k], d = quality->fft_im[n - k];
+    
+    *ref_power = 0.25 * ((a + c) * (a + c) + (b - d) * (b - d));
+    *deg_power = 0.25 * ((b + d) * (b + d) + (a - c) * (a - c));
+}
+
+// Log-spectral distance (dB) between two real frames, transformed together as
+// one complex FFT (ref in the real part, degraded in the imaginary part)
+static double quality_lsd(t_opus_quality *quality, const float *ref, const float *deg) {
+    int n = OPUS_QUALITY_FFT_SIZE;
+    
+    for (int i = 0; i < n; i++) {
+        quality->fft_re[i] = ref[i] * quality->window[i];
+        quality->fft_im[i] = deg[i] * quality->window[i];
+    }
+    quality_fft(quality);
+    
+    double ref_power, deg_power, peak = 0.0;
+    for (int k = 1; k < n / 2; k++) {
+        quality_split_bin(quality, k, &ref_power, &deg_power);
+        if (ref_power > peak) peak = ref_power;
+    }
+    
+    // Clamp both spectra to a floor relative to the reference peak, so bins
+    // above the coded bandwidth or near silence cannot dominate the distance
+    double floor_power = peak * pow(10.0, -OPUS_QUALITY_LSD_RANGE_DB / 10.0) + 1e-20;
+    
+    double sum = 0.0;
+    for (int k = 1; k < n / 2; k++) {
+        quality_split_bin(quality, k, &ref_power, &deg_power);
+        if (ref_power < floor_power) ref_power = floor_power;
+        if (deg_power < floor_power) deg_power = floor_power;
+        double diff = 10.0 * log10(ref_power / deg_power);
+        sum += diff * diff;
+    }
+    
+    return sqrt(sum / (n / 2 - 1));
+}
+
+// Score one full frame; silent frames are skipped
+static int quality_analyze_frame(t_opus_quality *quality) {
+    int n = OPUS_QUALITY_FFT_SIZE;
+    
+    double signal = 0.0, noise = 0.0;
+    for (int i = 0; i < n; i++) {
+        float err_left = quality->ref_left[i] - quality->deg_left[i];
+        float err_right = quality->ref_right[i] - quality->deg_right[i];
+        signal += quality->ref_left[i] * quality->ref_left[i] + quality->ref_right[i] * quality->ref_right[i];
+        noise += err_left * err_left + err_right * err_right;
+    }
+    
+    if (signal < OPUS_QUALITY_SILENCE_ENERGY * n * OPUS_CHANNELS) return 0;
+    
+    double snr = 10.0 * log10(signal / (noise + 1e-20));
+    if (snr < OPUS_QUALITY_SNR_MIN) snr = OPUS_QUALITY_SNR_MIN;
+    if (snr > OPUS_QUALITY_SNR_MAX) snr = OPUS_QUALITY_SNR_MAX;
+    
+    double lsd = 0.5 * (quality_lsd(quality, quality->ref_left, quality->deg_left) +
+                        quality_lsd(quality, quality->ref_right, quality->deg_right));
+    
+    quality->segmental_snr = snr;
+    quality->log_spectral_distance = lsd;
+    quality->snr_sum += snr;
+    quality->lsd_sum += lsd;
+    quality->frames++;
+    return 1;
+}
+
+// Feed a block of input and decoded output; delay is the codec latency from
+// opus_codec_get_latency. Returns the number of frames scored.
+int opus_quality_process(t_opus_quality *quality, const float *in_left, const float *in_right,
+                         const float *out_left, const float *out_right, int count, int delay) {
+    if (!quality || delay < 0) return 0;
+    if (atomic_exchange_explicit(&quality->reset_requested, 0, memory_order_acquire)) {
+        opus_quality_reset(quality);
+    }
+    if (delay >= OPUS_QUALITY_MAX_DELAY) delay = OPUS_QUALITY_MAX_DELAY - 1;
+    
+    // Latency changed (e.g. a codec swap) - drop the misaligned partial frame
+    if (delay != quality->delay) {
+        quality->delay = delay;
+        quality->frame_pos = 0;
+    }
+    
+    int scored = 0;
+    for (int i = 0; i < count; i++) {
+        quality->delay_left[quality->delay_pos] = in_left[i];
+        quality->delay_right[quality->delay_pos] = in_right[i];
+        
+        int read_pos = quality->delay_pos - delay;
+        if (read_pos < 0) read_pos += OPUS_QUALITY_MAX_DELAY;
+        
+        quality->delay_pos++;
+        if (quality->delay_pos >= OPUS_QUALITY_MAX_DELAY) quality->delay_pos = 0;
+        
+        // Wait until the delay line holds real input
+        if (quality->written <= delay) {
+            quality->written++;
+            continue;
+        }
+        
+        quality->ref_left[quality->frame_pos] = quality->delay_left[read_pos];
+        quality->ref_right[quality->frame_pos] = quality->delay_right[read_pos];
+        quality->deg_left[quality->frame_pos] = out_left[i];
+        quality->deg_right[quality->frame_pos] = out_right[i];
+        quality->frame_pos++;
+        
+        if (quality->frame_pos >= OPUS_QUALITY_FFT_SIZE) {
+            quality->frame_pos = 0;
+            scored += quality_analyze_frame(quality);
+        }
+    }
+    
+    return scored;
+}
+
+// Fresh codec with the reference's settings but the given bitrate/complexity
+static t_opus_codec* clone_codec(const t_opus_codec *reference, int bitrate, int complexity) {
+    t_opus_codec *codec = reference->custom ?
+        opus_codec_create_custom(reference->host_sample_rate, reference->frame_size) :
+        opus_codec_create(reference->host_sample_rate);
+    if (!codec) return NULL;
+    
+    if (!codec->custom) {
+        opus_codec_set_frame_size_ms(codec, (float)(reference->frame_size * 1000.0 / reference->sample_rate));
+        opus_codec_set_aggregation(codec, reference->aggregate_frames);
+    }
+    
+    opus_codec_set_bitrate(codec, bitrate);
+    opus_codec_set_complexity(codec, complexity);
+    opus_codec_set_vbr_mode(codec, reference->vbr_mode);
+    opus_codec_set_signal_type(codec, reference->signal_type);
+    opus_codec_set_packet_loss(codec, reference->packet_loss_perc);
+    opus_codec_set_dtx(codec, reference->use_dtx);
+    opus_codec_set_fec(codec, reference->use_fec);
+    
+    return codec;
+}
+
+// Run the input through a codec offline and average the quality metrics
+static int measure_settings(const t_opus_codec *reference, t_opus_quality *quality,
+                            const float *left, const float *right, int count,
+                            float *out_left, float *out_right,
+                            int bitrate, int complexity, const atomic_int *cancel,
+                            double *snr, double *lsd) {
+    if (cancel && atomic_load_explicit(cancel, memory_order_relaxed)) return OPUS_CODEC_ERROR;
+    
+    t_opus_codec *codec = clone_codec(reference, bitrate, complexity);
+    if (!codec) return OPUS_CODEC_ERROR;
+    
+    opus_quality_reset(quality);
+    int delay = opus_codec_get_latency(codec);
+    
+    // Frame-sized blocks so custom codecs take the in-place path
+    for (int offset = 0; offset + codec->frame_size <= count; offset += codec->frame_size) {
+        if (cancel && atomic_load_explicit(cancel, memory_order_relaxed)) {
+            opus_codec_destroy(codec);
+            return OPUS_CODEC_ERROR;
+        }
+        process_block(codec, left + offset, right + offset, out_left, out_right, codec->frame_size);
+        opus_quality_process(quality, left + offset, right + offset, out_left, out_right,
+                             codec->frame_size, delay);
+    }
+    
+    opus_codec_destroy(codec);
+    
+    if (quality->frames == 0) return OPUS_CODEC_ERROR;  // Input was silent
+    
+    *snr = quality->snr_sum / quality->frames;
+    *lsd = quality->lsd_sum / quality->frames;
     return OPUS_CODEC_OK;
-}
\ No newline at end of file
+}
+
+static int meets_threshold(double snr, double lsd, double min_snr, double max_lsd) {
+    return snr >= min_snr && (max_lsd <= 0.0 || lsd <= max_lsd);
+}
+
+// Find the lowest bitrate, then the lowest complexity at that bitrate, whose
+// average segmental SNR reaches min_snr (and LSD stays within max_lsd, if > 0)
+// on the given input. Runs offline - call off the audio thread. A nonzero
+// *cancel (may be NULL) stops it within a frame and returns OPUS_CODEC_ERROR.
+int opus_quality_sweep(const t_opus_codec *reference, const float *left, const float *right, int count,
+                       double min_snr, double max_lsd, const atomic_int *cancel,
+                       t_opus_sweep_result *result) {
+    static const int bitrates[] = {
+        6000, 8000, 12000, 16000, 20000, 24000, 32000, 40000, 48000, 64000,
+        80000, 96000, 128000, 160000, 192000, 256000, 320000, 384000, 510000
+    };
+    const int num_bitrates = (int)(sizeof(bitrates) / sizeof(bitrates[0]));
+    
+    if (!reference || !left || !right || !result) return OPUS_CODEC_ERROR;
+    memset(result, 0, sizeof(t_opus_sweep_result));
+    
+    t_opus_quality *quality = opus_quality_create();
+    float *out_left = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    float *out_right = (float*)calloc(OPUS_MAX_FRAME_SIZE, sizeof(float));
+    int status = OPUS_CODEC_ERROR;
+    int low = 0, high = num_bitrates - 1, found = -1;
+    double snr, lsd;
+    
+    if (!quality || !out_left || !out_right) goto done;
+    
+    // Quality rises with bitrate, so binary-search the bitrate at full complexity
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (measure_settings(reference, quality, left, right, count, out_left, out_right,
+                             bitrates[mid], 10, cancel, &snr, &lsd) != OPUS_CODEC_OK) goto done;
+        result->runs++;
+        
+        if (meets_threshold(snr, lsd, min_snr, max_lsd)) {
+            found = mid;
+            result->bitrate = bitrates[mid];
+            result->complexity = 10;
+            result->segmental_snr = snr;
+            result->log_spectral_distance = lsd;
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+    if (found < 0) goto done;
+    
+    // Then the cheapest complexity that still passes at that bitrate
+    for (int complexity = 0; complexity < 10; complexity++) {
+        if (measure_settings(reference, quality, left, right, count, out_left, out_right,
+                             bitrates[found], complexity, cancel, &snr, &lsd) != OPUS_CODEC_OK) goto done;
+        result->runs++;
+        
+        if (meets_threshold(snr, lsd, min_snr, max_lsd)) {
+            result->complexity = complexity;
+            result->segmental_snr = snr;
+            result->log_spectral_distance = lsd;
+            break;
+        }
+    }
+    status = OPUS_CODEC_OK;
+    
+done:
+    opus_quality_destroy(quality);
+    free(out_left);
+    free(out_right);
+    return status;
+}
@@ -2,10 +2,14 @@
 #define OPUS_CODEC_CORE_H
 
 #include <opus.h>
+#ifdef OPUS_CODEC_CUSTOM_MODES
+#include <opus_custom.h>
+#endif
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdatomic.h>
 
 // Configuration constants
 #define OPUS_DEFAULT_SAMPLE_RATE 48000
@@ -13,6 +17,23 @@
 #define OPUS_MAX_FRAME_SIZE (48000 * 60 / 1000)  // 60ms max at 48kHz for buffer allocation
 #define OPUS_MAX_PACKET_SIZE 4000
 #define OPUS_CHANNELS 2
+#define OPUS_MAX_BUNDLE_SIZE (48000 * 120 / 1000)  // 120ms max per aggregated packet at 48kHz
+#define OPUS_MAX_BUNDLE_FRAMES 48  // Opus packets carry at most 48 frames
+#define OPUS_MAX_BUNDLE_PACKET_SIZE (OPUS_MAX_BUNDLE_FRAMES * (1275 + 2) + 2)  // Frames + lengths + TOC/count
+#define OPUS_RING_CAPACITY (OPUS_MAX_BUNDLE_SIZE + OPUS_MAX_FRAME_SIZE * 3)  // Ring allocation, fits a bundle plus 3 frames
+#define OPUS_TRANSPORT_OVERHEAD 40  // IPv4 + UDP + RTP header bytes per packet, for aggregation stats
+#define OPUS_QUALITY_FFT_SIZE 512  // Analysis frame for the quality meter (power of two)
+#define OPUS_QUALITY_MAX_DELAY (OPUS_RING_CAPACITY + OPUS_MAX_FRAME_SIZE)  // Longest codec latency to align
+#define OPUS_QUALITY_SNR_MIN -10.0  // Segmental SNR clamp in dB
+#define OPUS_QUALITY_SNR_MAX 35.0
+#define OPUS_QUALITY_SILENCE_ENERGY 1e-7  // Mean power below which frames are not scored
+#define OPUS_QUALITY_LSD_RANGE_DB 80.0  // LSD floor below the frame's reference peak
+#define OPUS_SWEEP_SECONDS 3.0  // Input captured for a bitrate/complexity sweep
+#define OPUS_HISTORY_SIZE (OPUS_MAX_FRAME_SIZE * 4)  // Input history for pre-rolling replacement codecs
+#define OPUS_SWAP_FADE_MS 10.0  // Crossfade between old and new codec after a swap
+#define OPUS_SWAP_CATCHUP_FRAMES 2  // Extra frames of catch-up per vector beyond the vector itself
+#define OPUS_CUSTOM_MIN_FRAME_SIZE 64    // Custom-mode frame (signal vector) limits
+#define OPUS_CUSTOM_MAX_FRAME_SIZE 1024
 
 // Error codes
 #define OPUS_CODEC_OK 0
@@ -22,6 +43,14 @@
 typedef struct _opus_codec {
     OpusEncoder *encoder;
     OpusDecoder *decoder;
+#ifdef OPUS_CODEC_CUSTOM_MODES
+    OpusCustomMode *custom_mode;
+    OpusCustomEncoder *custom_encoder;
+    OpusCustomDecoder *custom_decoder;
+#endif
+    int custom;             // 1 = ultra-low-latency custom mode (CELT at host rate)
+    int custom_delay;       // Custom-mode algorithmic delay in samples
+    int custom_per_sample;  // Custom frames last fed sample by sample (one frame more delay)
     
     // Configuration parameters
     int sample_rate;        // Sample rate (8000, 12000, 16000, 24000, 48000)
@@ -33,6 +62,7 @@ typedef struct _opus_codec {
     int packet_loss_perc;  // Expected packet loss percentage
     int use_dtx;           // Discontinuous transmission
     int use_fec;           // Forward error correction
+    int host_sample_rate;  // Host sample rate the instance was created for
     
     // Buffers
     float *input_buffer_left;
@@ -60,13 +90,100 @@ typedef struct _opus_codec {
     int ring_read_pos;
     int ring_size;
     
+    // Packet aggregation: frames bundled into one packet via OpusRepacketizer
+    int aggregate_frames;           // Frames per packet (1 = no aggregation)
+    OpusRepacketizer *repacketizer;
+    unsigned char *frame_store;     // One OPUS_MAX_PACKET_SIZE slot per bundled frame
+    unsigned char *bundle_packet;   // Last aggregated packet
+    int bundle_count;               // Frames collected into the current bundle
+    int bundle_size;                // Size of bundle_packet in bytes
+    
+    // Aggregation statistics
+    long long stat_frames;          // Frames encoded
+    long long stat_packets;         // Packets emitted
+    long long stat_frame_bytes;     // Bytes if every frame were its own packet
+    long long stat_packet_bytes;    // Bytes actually emitted
+    
+    // Input sample count this instance has been pre-rolled up to (see swap)
+    long long history_pos;
+    
 } t_opus_codec;
 
+// Glitch-free reconfiguration: replacement instances are built and pre-rolled
+// off the audio thread, then swapped in with a short crossfade
+typedef struct _opus_codec_swap {
+    _Atomic(t_opus_codec *) active;   // Instance driven by the audio thread
+    _Atomic(t_opus_codec *) pending;  // Built off the audio thread, awaiting swap
+    _Atomic(t_opus_codec *) retired;  // Swapped out, awaiting reclamation
+    atomic_int in_flight;             // Submitted instances not yet active
+    
+    // Catch-up and crossfade state (audio thread only)
+    t_opus_codec *incoming;  // Taken from pending, catching up on input before going active
+    t_opus_codec *fading;  // Previous instance being faded out
+    int fade_pos;
+    int fade_len;
+    float *fade_left;      // Scratch output of the fading instance
+    float *fade_right;
+    
+    // Recent input history (written by the audio thread only)
+    float *history_left;
+    float *history_right;
+    atomic_llong history_count;  // Total input samples written
+    
+} t_opus_codec_swap;
+
+// Streaming quality meter: segmental SNR and log-spectral distance of the
+// decoded output against a delay-aligned copy of the input
+typedef struct _opus_quality {
+    // Input delay line
+    float *delay_left;
+    float *delay_right;
+    int delay;              // Alignment in samples (codec latency)
+    int delay_pos;
+    int written;            // Samples written, until the line is primed
+    
+    // Current analysis frame
+    float *ref_left;
+    float *ref_right;
+    float *deg_left;
+    float *deg_right;
+    int frame_pos;
+    
+    // FFT workspace and tables
+    float *fft_re;
+    float *fft_im;
+    float *window;
+    float *twiddle_re;
+    float *twiddle_im;
+    int *bitrev;
+    
+    // Results
+    double segmental_snr;          // Last frame, dB
+    double log_spectral_distance;  // Last frame, dB
+    double snr_sum;
+    double lsd_sum;
+    long long frames;              // Non-silent frames scored
+    
+    atomic_int reset_requested;    // Set by opus_quality_request_reset
+} t_opus_quality;
+
+// Cheapest settings found by opus_quality_sweep
+typedef struct _opus_sweep_result {
+    int bitrate;
+    int complexity;
+    double segmental_snr;          // Average over the input, dB
+    double log_spectral_distance;  // Average over the input, dB
+    int runs;                      // Settings evaluated
+} t_opus_sweep_result;
+
 // Function prototypes
 t_opus_codec* opus_codec_create(int sample_rate);
+t_opus_codec* opus_codec_create_custom(int host_sample_rate, int frame_size);
 void opus_codec_destroy(t_opus_codec *codec);
 int opus_codec_process_sample(t_opus_codec *codec, float in_left, float in_right, 
                               float *out_left, float *out_right);
+int opus_codec_process_frame(t_opus_codec *codec, const float *in_left, const float *in_right,
+                             float *out_left, float *out_right);
 int opus_codec_set_bitrate(t_opus_codec *codec, int bitrate);
 int opus_codec_set_complexity(t_opus_codec *codec, int complexity);
 int opus_codec_set_vbr_mode(t_opus_codec *codec, int mode);
@@ -77,5 +194,31 @@ int opus_codec_set_fec(t_opus_codec *codec, int enable);
 int opus_codec_reset(t_opus_codec *codec);
 int opus_codec_set_frame_size_ms(t_opus_codec *codec, float ms);
 int opus_codec_get_latency(t_opus_codec *codec);
+int opus_codec_set_aggregation(t_opus_codec *codec, int frames);
+int opus_codec_get_aggregation_latency(t_opus_codec *codec);
+long long opus_codec_get_bytes_saved(t_opus_codec *codec, int per_packet_overhead);
+int opus_codec_preroll(t_opus_codec *codec, const float *left, const float *right, int count);
+
+// Reconfiguration (submit/collect off the audio thread, poll/process on it)
+t_opus_codec_swap* opus_codec_swap_create(void);
+void opus_codec_swap_destroy(t_opus_codec_swap *swap);
+int opus_codec_swap_submit(t_opus_codec_swap *swap, t_opus_codec *codec);
+void opus_codec_swap_collect(t_opus_codec_swap *swap);
+t_opus_codec* opus_codec_swap_get_active(t_opus_codec_swap *swap);
+int opus_codec_swap_has_pending(t_opus_codec_swap *swap);
+int opus_codec_swap_poll(t_opus_codec_swap *swap);
+int opus_codec_swap_process_block(t_opus_codec_swap *swap, const float *in_left, const float *in_right,
+                                  float *out_left, float *out_right, int count);
+
+// Quality metering and settings sweep
+t_opus_quality* opus_quality_create(void);
+void opus_quality_destroy(t_opus_quality *quality);
+void opus_quality_reset(t_opus_quality *quality);
+void opus_quality_request_reset(t_opus_quality *quality);
+int opus_quality_process(t_opus_quality *quality, const float *in_left, const float *in_right,
+                         const float *out_left, const float *out_right, int count, int delay);
+int opus_quality_sweep(const t_opus_codec *reference, const float *left, const float *right, int count,
+                       double min_snr, double max_lsd, const atomic_int *cancel,
+                       t_opus_sweep_result *result);
 
 #endif
\ No newline at end of file
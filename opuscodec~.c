@@ -1,13 +1,49 @@
 #include "ext.h"
 #include "ext_obex.h"
 #include "z_dsp.h"
+#include "ext_systhread.h"
+#include <stdatomic.h>
 #include "opus_codec_core.h"
 
+// Sweep states. The audio thread claims the capture buffers by moving
+// CAPTURING -> WRITING and publishes the copied input when it moves back.
+enum {
+    SWEEP_IDLE,
+    SWEEP_CAPTURING,
+    SWEEP_ANALYZING,
+    SWEEP_WRITING
+};
+
 // Max external object structure
 typedef struct _opuscodec {
     t_pxobject ob;               // Max audio object
-    t_opus_codec *codec;         // Opus codec instance
+    t_opus_codec_swap *swap;     // Active Opus codec plus pending/retired instances
+    void *reclaim_qelem;         // Frees swapped-out codecs on the main thread
     double host_sample_rate;     // Host sample rate for compatibility
+    long vector_size;            // Signal vector size from dsp64
+    float *scratch;              // Float conversion buffers (4 x vector_size)
+    void *info_outlet;           // Quality and sweep reports
+    
+    // Quality meter
+    t_opus_quality *quality;     // Allocated on first 'meter 1'
+    long meter;                  // Meter enable/disable
+    void *meter_qelem;           // Reports meter results on the main thread
+    
+    // Bitrate/complexity sweep
+    float *sweep_left;           // Captured input
+    float *sweep_right;
+    long sweep_length;           // Samples to capture
+    long sweep_pos;              // Samples captured (audio thread)
+    atomic_long sweep_state;     // SWEEP_* state, shared with the audio thread
+    double sweep_min_snr;        // Required average segmental SNR (dB)
+    double sweep_max_lsd;        // Allowed average LSD (dB), 0 = ignore
+    void *sweep_qelem;           // Starts the analysis once capture completes
+    t_systhread sweep_thread;    // Analysis worker, NULL when not running
+    t_opus_codec *sweep_reference; // Codec with the current settings, owned by the worker
+    t_opus_sweep_result sweep_result;
+    int sweep_status;            // opus_quality_sweep return value
+    atomic_int sweep_cancel;     // Stops the worker and drops its result
+    void *sweep_done_qelem;      // Reports the worker's result on the main thread
     
     // Attributes for real-time parameter control
     long bitrate;                // Current bitrate
@@ -18,6 +54,8 @@ typedef struct _opuscodec {
     long dtx;                   // DTX enable/disable
     long fec;                   // FEC enable/disable
     double framesize;           // Frame size in ms
+    long lowlatency;            // Custom-mode frames matched to the signal vector
+    long aggregate;             // Frames bundled per packet (1 = off)
     
     // Status
     long bypass;                // Bypass mode
@@ -47,6 +85,26 @@ void opuscodec_fec(t_opuscodec *x, long enable);
 void opuscodec_framesize(t_opuscodec *x, double ms);
 void opuscodec_bypass(t_opuscodec *x, long bypass);
 void opuscodec_reset(t_opuscodec *x);
+void opuscodec_lowlatency(t_opuscodec *x, long enable);
+void opuscodec_latency(t_opuscodec *x);
+void opuscodec_aggregate(t_opuscodec *x, long frames);
+void opuscodec_stats(t_opuscodec *x);
+void opuscodec_meter(t_opuscodec *x, long enable);
+void opuscodec_sweep(t_opuscodec *x, double min_snr, double max_lsd);
+
+// Reconfiguration helpers
+t_opus_codec *opuscodec_build_codec(t_opuscodec *x, double samplerate);
+void opuscodec_reconfigure(t_opuscodec *x, double samplerate);
+void opuscodec_reclaim(t_opuscodec *x);
+void opuscodec_sync_pending(t_opuscodec *x, t_opus_codec *applied);
+void opuscodec_defer(t_opuscodec *x, t_symbol *s, long argc, t_atom *argv);
+void opuscodec_dispatch(t_opuscodec *x, t_symbol *s, long argc, t_atom *argv);
+void opuscodec_meter_report(t_opuscodec *x);
+void opuscodec_sweep_run(t_opuscodec *x);
+void *opuscodec_sweep_worker(t_opuscodec *x);
+void opuscodec_sweep_done(t_opuscodec *x);
+void opuscodec_sweep_capture(t_opuscodec *x, const double *in_left, const double *in_right, long frames);
+long opuscodec_sweep_stop_capture(t_opuscodec *x);
 
 // No attribute setters needed - using message system
 
@@ -60,17 +118,16 @@ void ext_main(void *r) {
     class_addmethod(c, (method)opuscodec_dsp64, "dsp64", A_CANT, 0);
     class_addmethod(c, (method)opuscodec_assist, "assist", A_CANT, 0);
     
-    // Message-based parameter control (no attributes - they're unreliable)
-    class_addmethod(c, (method)opuscodec_bitrate, "bitrate", A_LONG, 0);
-    class_addmethod(c, (method)opuscodec_complexity, "complexity", A_LONG, 0);
-    class_addmethod(c, (method)opuscodec_vbr, "vbr", A_LONG, 0);
-    class_addmethod(c, (method)opuscodec_mode, "mode", A_SYM, 0);
-    class_addmethod(c, (method)opuscodec_loss, "loss", A_LONG, 0);
-    class_addmethod(c, (method)opuscodec_dtx, "dtx", A_LONG, 0);
-    class_addmethod(c, (method)opuscodec_fec, "fec", A_LONG, 0);
-    class_addmethod(c, (method)opuscodec_framesize, "framesize", A_FLOAT, 0);
+    // Message-based parameter control (no attributes - they're unreliable).
+    // Everything that touches a codec is deferred to the main thread.
+    const char *deferred[] = {
+        "bitrate", "complexity", "vbr", "mode", "loss", "dtx", "fec", "framesize",
+        "reset", "lowlatency", "latency", "aggregate", "stats", "meter", "sweep"
+    };
+    for (int i = 0; i < (int)(sizeof(deferred) / sizeof(deferred[0])); i++) {
+        class_addmethod(c, (method)opuscodec_defer, deferred[i], A_GIMME, 0);
+    }
     class_addmethod(c, (method)opuscodec_bypass, "bypass", A_LONG, 0);
-    class_addmethod(c, (method)opuscodec_reset, "reset", 0);
     
     class_dspinit(c);
     class_register(CLASS_BOX, c);
@@ -84,8 +141,9 @@ void *opuscodec_new(t_symbol *s, long argc, t_atom *argv) {
     t_opuscodec *x = (t_opuscodec *)object_alloc(opuscodec_class);
     
     if (x) {
-        // Initialize DSP with 2 inlets and 2 outlets (stereo)
+        // Initialize DSP with 2 inlets and 2 outlets (stereo), info outlet rightmost
         dsp_setup((t_pxobject *)x, 2);
+        x->info_outlet = outlet_new(x, NULL);
         outlet_new(x, "signal");
         outlet_new(x, "signal");
         
@@ -98,6 +156,8 @@ void *opuscodec_new(t_symbol *s, long argc, t_atom *argv) {
         x->dtx = 0;              // DTX disabled for reliability
         x->fec = 0;
         x->framesize = 20.0;     // 20ms frames for standard quality
+        x->lowlatency = 0;       // Standard Opus frames by default
+        x->aggregate = 1;        // One frame per packet
         x->bypass = 0;
         
         // Process positional arguments (no attributes)
@@ -109,8 +169,31 @@ void *opuscodec_new(t_symbol *s, long argc, t_atom *argv) {
         }
         
         // Codec will be created in dsp64 method when sample rate is known
-        x->codec = NULL;
+        x->swap = opus_codec_swap_create();
+        x->reclaim_qelem = qelem_new(x, (method)opuscodec_reclaim);
+        
+        // Quality meter and sweep are set up on demand
+        x->quality = NULL;
+        x->meter = 0;
+        x->meter_qelem = qelem_new(x, (method)opuscodec_meter_report);
+        x->sweep_left = NULL;
+        x->sweep_right = NULL;
+        x->sweep_length = 0;
+        x->sweep_pos = 0;
+        atomic_init(&x->sweep_state, SWEEP_IDLE);
+        x->sweep_qelem = qelem_new(x, (method)opuscodec_sweep_run);
+        x->sweep_thread = NULL;
+        x->sweep_reference = NULL;
+        x->sweep_status = OPUS_CODEC_ERROR;
+        atomic_init(&x->sweep_cancel, 0);
+        x->sweep_done_qelem = qelem_new(x, (method)opuscodec_sweep_done);
         x->host_sample_rate = 48000.0;  // Default assumption
+        x->vector_size = 64;
+        x->scratch = NULL;
+        
+        if (!x->swap) {
+            object_error((t_object *)x, "Failed to allocate codec swap state");
+        }
         
         post("opuscodec~: External created - codec will initialize on DSP start");
         post("opuscodec~: Default settings - bitrate=%ld kbps, complexity=%ld, framesize=%.1fms, mode=%s", 
@@ -125,8 +208,22 @@ void *opuscodec_new(t_symbol *s, long argc, t_atom *argv) {
 // Destructor
 void opuscodec_free(t_opuscodec *x) {
     dsp_free((t_pxobject *)x);
-    if (x->codec) {
-        opus_codec_destroy(x->codec);
+    qelem_free(x->reclaim_qelem);
+    qelem_free(x->meter_qelem);
+    qelem_free(x->sweep_qelem);
+    if (x->sweep_thread) {
+        unsigned int ret;
+        atomic_store(&x->sweep_cancel, 1);
+        systhread_join(x->sweep_thread, &ret);
+    }
+    qelem_free(x->sweep_done_qelem);
+    opus_codec_destroy(x->sweep_reference);
+    opus_codec_swap_destroy(x->swap);
+    opus_quality_destroy(x->quality);
+    if (x->sweep_left) sysmem_freeptr(x->sweep_left);
+    if (x->sweep_right) sysmem_freeptr(x->sweep_right);
+    if (x->scratch) {
+        sysmem_freeptr(x->scratch);
     }
 }
 
@@ -141,43 +238,134 @@ void opuscodec_assist(t_opuscodec *x, void *b, long m, long a, char *s) {
         switch (a) {
             case 0: strcpy(s, "(signal) Left Output"); break;
             case 1: strcpy(s, "(signal) Right Output"); break;
+            case 2: strcpy(s, "(list) Quality meter and sweep results"); break;
         }
     }
 }
 
+// Build a fully configured codec from the current settings (main thread only)
+t_opus_codec *opuscodec_build_codec(t_opuscodec *x, double samplerate) {
+    t_opus_codec *codec = NULL;
+    
+    // Low-latency mode: custom-mode frame equal to the signal vector at the host rate
+    if (x->lowlatency) {
+        codec = opus_codec_create_custom((int)samplerate, (int)x->vector_size);
+        if (!codec) {
+            // Fall back for good, so DSP restarts don't retry and the state reads true
+            object_error((t_object *)x, "Low-latency mode unavailable for %.0f Hz / %ld-sample vectors "
+                         "(needs libopus custom modes and an even vector size of %d-%d) - disabled, using standard frames",
+                         samplerate, x->vector_size, OPUS_CUSTOM_MIN_FRAME_SIZE, OPUS_CUSTOM_MAX_FRAME_SIZE);
+            x->lowlatency = 0;
+        }
+    }
+    
+    if (!codec) codec = opus_codec_create((int)samplerate);
+    if (!codec) return NULL;
+    
+    // Apply all attribute values to new codec instance
+    opus_codec_set_bitrate(codec, x->bitrate);
+    opus_codec_set_complexity(codec, x->complexity);
+    opus_codec_set_vbr_mode(codec, x->vbr_mode);
+    opus_codec_set_frame_size_ms(codec, (float)x->framesize);
+    opus_codec_set_dtx(codec, x->dtx);
+    opus_codec_set_fec(codec, x->fec);
+    opus_codec_set_packet_loss(codec, x->packet_loss);
+    
+    // Packet aggregation (after frame size, which bounds the bundle length)
+    if (x->aggregate > 1 && !codec->custom &&
+        opus_codec_set_aggregation(codec, (int)x->aggregate) != OPUS_CODEC_OK) {
+        object_error((t_object *)x, "Cannot bundle %ld x %.1f ms frames (max 120 ms) - sending single frames",
+                     x->aggregate, x->framesize);
+    }
+    
+    // Set signal type
+    int sig_type = (x->signal_type == gensym("voice")) ? OPUS_SIGNAL_VOICE : OPUS_SIGNAL_MUSIC;
+    opus_codec_set_signal_type(codec, sig_type);
+    
+    return codec;
+}
+
+// Build a replacement codec off the audio thread; perform64 swaps it in with a crossfade
+void opuscodec_reconfigure(t_opuscodec *x, double samplerate) {
+    if (!x->swap) return;
+    
+    t_opus_codec *codec = opuscodec_build_codec(x, samplerate);
+    if (!codec) {
+        object_error((t_object *)x, "Failed to create Opus codec for sample rate %.0f Hz", samplerate);
+        return;
+    }
+    
+    opus_codec_swap_submit(x->swap, codec);
+}
+
+// Free codecs retired by the audio thread
+void opuscodec_reclaim(t_opuscodec *x) {
+    opus_codec_swap_collect(x->swap);
+}
+
+// A setting was just applied to 'applied' (the active codec, or NULL). A rebuilt
+// codec still waiting in the swap, or one that went active meanwhile, was built
+// with the old value - rebuild it from the current settings.
+void opuscodec_sync_pending(t_opuscodec *x, t_opus_codec *applied) {
+    if (opus_codec_swap_has_pending(x->swap) || opus_codec_swap_get_active(x->swap) != applied) {
+        opuscodec_reconfigure(x, x->host_sample_rate);
+    }
+}
+
+// Messages can arrive on the scheduler or audio thread (Overdrive, Max for Live
+// automation); codec builds and active/pending access stay on the main thread
+void opuscodec_defer(t_opuscodec *x, t_symbol *s, long argc, t_atom *argv) {
+    defer_low(x, (method)opuscodec_dispatch, s, (short)argc, argv);
+}
+
+void opuscodec_dispatch(t_opuscodec *x, t_symbol *s, long argc, t_atom *argv) {
+    if (s == gensym("reset")) opuscodec_reset(x);
+    else if (s == gensym("latency")) opuscodec_latency(x);
+    else if (s == gensym("stats")) opuscodec_stats(x);
+    else if (argc < 1) object_error((t_object *)x, "%s needs an argument", s->s_name);
+    else if (s == gensym("bitrate")) opuscodec_bitrate(x, atom_getlong(argv));
+    else if (s == gensym("complexity")) opuscodec_complexity(x, atom_getlong(argv));
+    else if (s == gensym("vbr")) opuscodec_vbr(x, atom_getlong(argv));
+    else if (s == gensym("mode")) opuscodec_mode(x, atom_getsym(argv));
+    else if (s == gensym("loss")) opuscodec_loss(x, atom_getlong(argv));
+    else if (s == gensym("dtx")) opuscodec_dtx(x, atom_getlong(argv));
+    else if (s == gensym("fec")) opuscodec_fec(x, atom_getlong(argv));
+    else if (s == gensym("framesize")) opuscodec_framesize(x, atom_getfloat(argv));
+    else if (s == gensym("lowlatency")) opuscodec_lowlatency(x, atom_getlong(argv));
+    else if (s == gensym("aggregate")) opuscodec_aggregate(x, atom_getlong(argv));
+    else if (s == gensym("meter")) opuscodec_meter(x, atom_getlong(argv));
+    else if (s == gensym("sweep")) opuscodec_sweep(x, atom_getfloat(argv), argc > 1 ? atom_getfloat(argv + 1) : 0.0);
+}
+
 // DSP setup
 void opuscodec_dsp64(t_opuscodec *x, t_object *dsp64, short *count, double samplerate, long maxvectorsize, long flags) {
     // Store host sample rate
     x->host_sample_rate = samplerate;
     
-    // Recreate codec if sample rate changed
-    if (x->codec) {
-        opus_codec_destroy(x->codec);
+    if (!x->swap) return;
+    
+    // Float conversion buffers for block processing
+    if (!x->scratch || maxvectorsize != x->vector_size) {
+        if (x->scratch) sysmem_freeptr(x->scratch);
+        x->scratch = (float *)sysmem_newptrclear(4 * maxvectorsize * sizeof(float));
     }
+    x->vector_size = maxvectorsize;
     
-    // Create codec with host sample rate
-    x->codec = opus_codec_create((int)samplerate);
-    if (!x->codec) {
-        object_error((t_object *)x, "Failed to create Opus codec for sample rate %.0f Hz", samplerate);
+    if (!x->scratch) {
+        object_error((t_object *)x, "Failed to allocate processing buffers");
         return;
     }
     
-    // Apply all attribute values to new codec instance
-    opus_codec_set_bitrate(x->codec, x->bitrate);
-    opus_codec_set_complexity(x->codec, x->complexity);
-    opus_codec_set_vbr_mode(x->codec, x->vbr_mode);
-    opus_codec_set_frame_size_ms(x->codec, (float)x->framesize);
-    opus_codec_set_dtx(x->codec, x->dtx);
-    opus_codec_set_fec(x->codec, x->fec);
-    opus_codec_set_packet_loss(x->codec, x->packet_loss);
-    
-    // Set signal type
-    int sig_type = (x->signal_type == gensym("voice")) ? OPUS_SIGNAL_VOICE : OPUS_SIGNAL_MUSIC;
-    opus_codec_set_signal_type(x->codec, sig_type);
-    
-    post("opuscodec~: Codec created for %.0f Hz sample rate", samplerate);
-    post("opuscodec~: Applied attributes - bitrate=%ld, complexity=%ld, mode=%s", 
-         x->bitrate, x->complexity, x->signal_type ? x->signal_type->s_name : "music");
+    // Rebuild codec only if there is none yet, the sample rate changed, or
+    // low-latency frames no longer match the vector size
+    t_opus_codec *active = opus_codec_swap_get_active(x->swap);
+    if (!active || active->host_sample_rate != (int)samplerate ||
+        (x->lowlatency && (!active->custom || active->frame_size != maxvectorsize))) {
+        opuscodec_reconfigure(x, samplerate);
+        post("opuscodec~: Codec created for %.0f Hz sample rate", samplerate);
+        post("opuscodec~: Applied attributes - bitrate=%ld, complexity=%ld, mode=%s", 
+             x->bitrate, x->complexity, x->signal_type ? x->signal_type->s_name : "music");
+    }
     
     object_method(dsp64, gensym("dsp_add64"), x, opuscodec_perform64, 0, NULL);
 }
@@ -189,7 +377,21 @@ void opuscodec_perform64(t_opuscodec *x, t_object *dsp64, double **ins, long num
     double *out_left = outs[0];
     double *out_right = outs[1];
     
-    if (x->bypass || !x->codec) {
+    // Pick up a reconfigured codec, if one is ready
+    if (x->swap && opus_codec_swap_poll(x->swap)) {
+        qelem_set(x->reclaim_qelem);
+    }
+    
+    // Capture input for a pending sweep, whether or not the codec is running
+    if (atomic_load_explicit(&x->sweep_state, memory_order_acquire) == SWEEP_CAPTURING) {
+        opuscodec_sweep_capture(x, in_left, in_right, sampleframes);
+    }
+    
+    // A swap still in flight keeps the codec running under bypass so the
+    // new instance can catch up and go active
+    int swapping = opus_codec_swap_has_pending(x->swap);
+    
+    if (!x->scratch || (x->bypass && !swapping) || (!opus_codec_swap_get_active(x->swap) && !swapping)) {
         // Bypass mode - just copy input to output
         for (long i = 0; i < sampleframes; i++) {
             out_left[i] = in_left[i];
@@ -198,26 +400,46 @@ void opuscodec_perform64(t_opuscodec *x, t_object *dsp64, double **ins, long num
         return;
     }
     
-    // Process each sample through Opus codec
-    for (long i = 0; i < sampleframes; i++) {
-        float opus_out_left, opus_out_right;
+    // Process the vector through the Opus codec in float blocks
+    float *block_in_left = x->scratch;
+    float *block_in_right = x->scratch + x->vector_size;
+    float *block_out_left = x->scratch + 2 * x->vector_size;
+    float *block_out_right = x->scratch + 3 * x->vector_size;
+    
+    for (long offset = 0; offset < sampleframes; offset += x->vector_size) {
+        long count = sampleframes - offset;
+        if (count > x->vector_size) count = x->vector_size;
         
-        int result = opus_codec_process_sample(x->codec, 
-                                              (float)in_left[i], 
-                                              (float)in_right[i],
-                                              &opus_out_left, 
-                                              &opus_out_right);
+        for (long i = 0; i < count; i++) {
+            block_in_left[i] = (float)in_left[offset + i];
+            block_in_right[i] = (float)in_right[offset + i];
+        }
+        
+        // Errors leave silence in the output block
+        opus_codec_swap_process_block(x->swap, block_in_left, block_in_right,
+                                      block_out_left, block_out_right, (int)count);
+        
+        if (x->bypass) {
+            for (long i = 0; i < count; i++) {
+                out_left[offset + i] = in_left[offset + i];
+                out_right[offset + i] = in_right[offset + i];
+            }
+            continue;
+        }
         
-        if (result == OPUS_CODEC_OK) {
-            out_left[i] = (double)opus_out_left;
-            out_right[i] = (double)opus_out_right;
-        } else {
-            // Error - output silence
-            out_left[i] = 0.0;
-            out_right[i] = 0.0;
+        // Score decoded output against the input, aligned by the codec latency
+        if (x->meter && x->quality) {
+            int delay = opus_codec_get_latency(opus_codec_swap_get_active(x->swap));
+            if (opus_quality_process(x->quality, block_in_left, block_in_right,
+                                     block_out_left, block_out_right, (int)count, delay)) {
+                qelem_set(x->meter_qelem);
+            }
         }
         
-        // Clean processing - no debug output
+        for (long i = 0; i < count; i++) {
+            out_left[offset + i] = (double)block_out_left[i];
+            out_right[offset + i] = (double)block_out_right[i];
+        }
     }
 }
 
@@ -225,9 +447,11 @@ void opuscodec_perform64(t_opuscodec *x, t_object *dsp64, double **ins, long num
 void opuscodec_bitrate(t_opuscodec *x, long bitrate) {
     if (bitrate >= 6000 && bitrate <= 510000) {
         x->bitrate = bitrate;
-        if (x->codec) {
-            opus_codec_set_bitrate(x->codec, bitrate);
+        t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+        if (codec) {
+            opus_codec_set_bitrate(codec, bitrate);
         }
+        opuscodec_sync_pending(x, codec);
         post("opuscodec~: Bitrate set to %ld bps (%.1f kbps)", bitrate, bitrate/1000.0);
     } else {
         object_error((t_object *)x, "Bitrate must be between 6000 and 510000 bps");
@@ -237,9 +461,11 @@ void opuscodec_bitrate(t_opuscodec *x, long bitrate) {
 void opuscodec_complexity(t_opuscodec *x, long complexity) {
     if (complexity >= 0 && complexity <= 10) {
         x->complexity = complexity;
-        if (x->codec) {
-            opus_codec_set_complexity(x->codec, complexity);
+        t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+        if (codec) {
+            opus_codec_set_complexity(codec, complexity);
         }
+        opuscodec_sync_pending(x, codec);
         post("opuscodec~: Complexity set to %ld", complexity);
     } else {
         object_error((t_object *)x, "Complexity must be between 0 and 10");
@@ -249,9 +475,11 @@ void opuscodec_complexity(t_opuscodec *x, long complexity) {
 void opuscodec_vbr(t_opuscodec *x, long mode) {
     if (mode >= 0 && mode <= 2) {
         x->vbr_mode = mode;
-        if (x->codec) {
-            opus_codec_set_vbr_mode(x->codec, mode);
+        t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+        if (codec) {
+            opus_codec_set_vbr_mode(codec, mode);
         }
+        opuscodec_sync_pending(x, codec);
         const char* mode_names[] = {"CBR", "VBR", "CVBR"};
         post("opuscodec~: VBR mode set to %ld (%s)", mode, mode_names[mode]);
     } else {
@@ -262,10 +490,12 @@ void opuscodec_vbr(t_opuscodec *x, long mode) {
 void opuscodec_mode(t_opuscodec *x, t_symbol *type) {
     if (type == gensym("voice") || type == gensym("music")) {
         x->signal_type = type;
-        if (x->codec) {
+        t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+        if (codec) {
             int sig_type = (type == gensym("voice")) ? OPUS_SIGNAL_VOICE : OPUS_SIGNAL_MUSIC;
-            opus_codec_set_signal_type(x->codec, sig_type);
+            opus_codec_set_signal_type(codec, sig_type);
         }
+        opuscodec_sync_pending(x, codec);
         post("opuscodec~: Signal mode set to %s", type->s_name);
     } else {
         object_error((t_object *)x, "Signal mode must be 'voice' or 'music'");
@@ -275,9 +505,11 @@ void opuscodec_mode(t_opuscodec *x, t_symbol *type) {
 void opuscodec_loss(t_opuscodec *x, long percentage) {
     if (percentage >= 0 && percentage <= 100) {
         x->packet_loss = percentage;
-        if (x->codec) {
-            opus_codec_set_packet_loss(x->codec, percentage);
+        t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+        if (codec) {
+            opus_codec_set_packet_loss(codec, percentage);
         }
+        opuscodec_sync_pending(x, codec);
         post("opuscodec~: Expected packet loss set to %ld%%", percentage);
     } else {
         object_error((t_object *)x, "Packet loss must be between 0 and 100 percent");
@@ -286,17 +518,21 @@ void opuscodec_loss(t_opuscodec *x, long percentage) {
 
 void opuscodec_dtx(t_opuscodec *x, long enable) {
     x->dtx = enable ? 1 : 0;
-    if (x->codec) {
-        opus_codec_set_dtx(x->codec, x->dtx);
+    t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+    if (codec) {
+        opus_codec_set_dtx(codec, x->dtx);
     }
+    opuscodec_sync_pending(x, codec);
     post("opuscodec~: DTX (discontinuous transmission) %s", x->dtx ? "enabled" : "disabled");
 }
 
 void opuscodec_fec(t_opuscodec *x, long enable) {
     x->fec = enable ? 1 : 0;
-    if (x->codec) {
-        opus_codec_set_fec(x->codec, x->fec);
+    t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+    if (codec) {
+        opus_codec_set_fec(codec, x->fec);
     }
+    opuscodec_sync_pending(x, codec);
     post("opuscodec~: FEC (forward error correction) %s", x->fec ? "enabled" : "disabled");
 }
 
@@ -304,9 +540,13 @@ void opuscodec_framesize(t_opuscodec *x, double ms) {
     // Valid frame sizes: 2.5, 5, 10, 20, 40, 60 ms
     if (ms == 2.5 || ms == 5.0 || ms == 10.0 || ms == 20.0 || ms == 40.0 || ms == 60.0) {
         x->framesize = ms;
-        if (x->codec) {
-            opus_codec_set_frame_size_ms(x->codec, (float)ms);
+        // Custom-mode frames follow the signal vector; keep the new size for later
+        t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+        if (x->lowlatency && codec && codec->custom && !opus_codec_swap_has_pending(x->swap)) {
+            post("opuscodec~: Frame size set to %.1f ms (applies when low-latency mode is disabled)", ms);
+            return;
         }
+        opuscodec_reconfigure(x, x->host_sample_rate);
         post("opuscodec~: Frame size set to %.1f ms", ms);
     } else {
         object_error((t_object *)x, "Frame size must be 2.5, 5, 10, 20, 40, or 60 ms");
@@ -323,10 +563,243 @@ void opuscodec_bypass(t_opuscodec *x, long bypass) {
 }
 
 void opuscodec_reset(t_opuscodec *x) {
-    if (x->codec) {
-        opus_codec_reset(x->codec);
+    t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+    if (codec) {
+        opus_codec_reset(codec);
         post("opuscodec~: Codec reset");
     }
 }
 
+void opuscodec_lowlatency(t_opuscodec *x, long enable) {
+    if ((enable ? 1 : 0) == x->lowlatency) {
+        post("opuscodec~: Low-latency mode already %s", x->lowlatency ? "enabled" : "disabled");
+        return;
+    }
+    x->lowlatency = enable ? 1 : 0;
+    opuscodec_reconfigure(x, x->host_sample_rate);
+    
+    if (x->lowlatency) {
+        post("opuscodec~: Low-latency mode enabled - %ld-sample custom frames at %.0f Hz",
+             x->vector_size, x->host_sample_rate);
+    } else {
+        post("opuscodec~: Low-latency mode disabled - %.1f ms frames", x->framesize);
+    }
+}
+
+void opuscodec_latency(t_opuscodec *x) {
+    t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+    if (codec) {
+        int samples = opus_codec_get_latency(codec);
+        post("opuscodec~: Latency %d samples (%.2f ms)%s", samples,
+             samples * 1000.0 / x->host_sample_rate, codec->custom ? " - low-latency mode" : "");
+    } else {
+        post("opuscodec~: Latency unknown - codec initializes on DSP start");
+    }
+}
+
+void opuscodec_aggregate(t_opuscodec *x, long frames) {
+    if (frames >= 1 && frames <= OPUS_MAX_BUNDLE_FRAMES) {
+        x->aggregate = frames;
+        // Custom-mode codecs send every frame on its own; keep the value for later
+        t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+        if (x->lowlatency && codec && codec->custom && !opus_codec_swap_has_pending(x->swap)) {
+            post("opuscodec~: Aggregation set to %ld frame%s per packet (applies when low-latency mode is disabled)",
+                 frames, frames == 1 ? "" : "s");
+            return;
+        }
+        opuscodec_reconfigure(x, x->host_sample_rate);
+        post("opuscodec~: Aggregation set to %ld frame%s per packet (%.1f ms)",
+             frames, frames == 1 ? "" : "s", frames * x->framesize);
+    } else {
+        object_error((t_object *)x, "Aggregation must be between 1 and %d frames", OPUS_MAX_BUNDLE_FRAMES);
+    }
+}
+
+void opuscodec_stats(t_opuscodec *x) {
+    t_opus_codec *codec = opus_codec_swap_get_active(x->swap);
+    if (!codec) {
+        post("opuscodec~: No stats - codec initializes on DSP start");
+        return;
+    }
+    
+    long long saved = opus_codec_get_bytes_saved(codec, OPUS_TRANSPORT_OVERHEAD);
+    long long unbundled = codec->stat_frame_bytes + codec->stat_frames * OPUS_TRANSPORT_OVERHEAD;
+    int added = opus_codec_get_aggregation_latency(codec);
+    
+    post("opuscodec~: %lld frames in %lld packets, %lld payload bytes",
+         codec->stat_frames, codec->stat_packets, codec->stat_packet_bytes);
+    post("opuscodec~: Overhead saved %lld bytes (%.1f%% with %d-byte headers), latency added %.2f ms",
+         saved, unbundled > 0 ? 100.0 * saved / unbundled : 0.0, OPUS_TRANSPORT_OVERHEAD,
+         added * 1000.0 / x->host_sample_rate);
+}
+
+void opuscodec_meter(t_opuscodec *x, long enable) {
+    if (enable && !x->quality) {
+        x->quality = opus_quality_create();
+        if (!x->quality) {
+            object_error((t_object *)x, "Failed to allocate quality meter");
+            return;
+        }
+    }
+    
+    // The audio thread owns the meter state; it resets on its next block
+    if (enable) opus_quality_request_reset(x->quality);
+    x->meter = enable ? 1 : 0;
+    post("opuscodec~: Quality meter %s", x->meter ? "enabled" : "disabled");
+}
+
+// Output: quality <frame snr> <frame lsd> <avg snr> <avg lsd>
+void opuscodec_meter_report(t_opuscodec *x) {
+    t_opus_quality *q = x->quality;
+    if (!q || q->frames == 0) return;
+    
+    t_atom av[4];
+    atom_setfloat(av, q->segmental_snr);
+    atom_setfloat(av + 1, q->log_spectral_distance);
+    atom_setfloat(av + 2, q->snr_sum / q->frames);
+    atom_setfloat(av + 3, q->lsd_sum / q->frames);
+    outlet_anything(x->info_outlet, gensym("quality"), 4, av);
+}
+
+// Audio thread: append a vector to the sweep capture
+void opuscodec_sweep_capture(t_opuscodec *x, const double *in_left, const double *in_right, long frames) {
+    long expected = SWEEP_CAPTURING;
+    if (!atomic_compare_exchange_strong_explicit(&x->sweep_state, &expected, SWEEP_WRITING,
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    
+    long n = x->sweep_length - x->sweep_pos;
+    if (n > frames) n = frames;
+    for (long i = 0; i < n; i++) {
+        x->sweep_left[x->sweep_pos + i] = (float)in_left[i];
+        x->sweep_right[x->sweep_pos + i] = (float)in_right[i];
+    }
+    x->sweep_pos += n;
+    
+    if (x->sweep_pos >= x->sweep_length) {
+        atomic_store_explicit(&x->sweep_state, SWEEP_ANALYZING, memory_order_release);
+        qelem_set(x->sweep_qelem);
+    } else {
+        atomic_store_explicit(&x->sweep_state, SWEEP_CAPTURING, memory_order_release);
+    }
+}
+
+// Main thread: abandon a capture in progress, waiting out a vector being
+// copied. Returns the state left behind (idle, or analyzing).
+long opuscodec_sweep_stop_capture(t_opuscodec *x) {
+    for (;;) {
+        long expected = SWEEP_CAPTURING;
+        if (atomic_compare_exchange_weak_explicit(&x->sweep_state, &expected, SWEEP_IDLE,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            return SWEEP_IDLE;
+        }
+        if (expected != SWEEP_WRITING && expected != SWEEP_CAPTURING) return expected;
+    }
+}
+
+void opuscodec_sweep(t_opuscodec *x, double min_snr, double max_lsd) {
+    long state = opuscodec_sweep_stop_capture(x);
+    
+    // 'sweep 0' cancels; a running worker stops within a frame
+    if (min_snr == 0.0) {
+        if (x->sweep_thread) {
+            atomic_store(&x->sweep_cancel, 1);
+        } else if (state == SWEEP_ANALYZING) {
+            atomic_store_explicit(&x->sweep_state, SWEEP_IDLE, memory_order_release);
+        }
+        post("opuscodec~: Sweep cancelled");
+        return;
+    }
+    if (state != SWEEP_IDLE) {
+        object_error((t_object *)x, "Sweep analysis in progress ('sweep 0' cancels)");
+        return;
+    }
+    
+    long length = (long)(x->host_sample_rate * OPUS_SWEEP_SECONDS);
+    if (length != x->sweep_length || !x->sweep_left || !x->sweep_right) {
+        if (x->sweep_left) sysmem_freeptr(x->sweep_left);
+        if (x->sweep_right) sysmem_freeptr(x->sweep_right);
+        x->sweep_left = (float *)sysmem_newptr(length * sizeof(float));
+        x->sweep_right = (float *)sysmem_newptr(length * sizeof(float));
+        x->sweep_length = length;
+    }
+    
+    if (!x->sweep_left || !x->sweep_right) {
+        object_error((t_object *)x, "Failed to allocate sweep buffers");
+        x->sweep_length = 0;
+        return;
+    }
+    
+    x->sweep_min_snr = min_snr;
+    x->sweep_max_lsd = max_lsd;
+    x->sweep_pos = 0;
+    atomic_store_explicit(&x->sweep_state, SWEEP_CAPTURING, memory_order_release);
+    post("opuscodec~: Sweep capturing %.1f s of input (target SNR >= %.1f dB%s)",
+         OPUS_SWEEP_SECONDS, min_snr, max_lsd > 0.0 ? ", LSD limit set" : "");
+}
+
+// Capture complete: hand the analysis to a worker thread, which replays
+// the input through roughly 15 codec instances
+void opuscodec_sweep_run(t_opuscodec *x) {
+    // Cancelled before the analysis started
+    if (atomic_load_explicit(&x->sweep_state, memory_order_acquire) != SWEEP_ANALYZING) return;
+    
+    // The worker gets its own codec with the current settings; the active
+    // one belongs to the audio thread
+    x->sweep_reference = opus_codec_swap_get_active(x->swap) ?
+                         opuscodec_build_codec(x, x->host_sample_rate) : NULL;
+    atomic_store(&x->sweep_cancel, 0);
+    
+    if (!x->sweep_reference ||
+        systhread_create((method)opuscodec_sweep_worker, x, 0, 0, 0, &x->sweep_thread) != 0) {
+        object_error((t_object *)x, "Could not start sweep analysis (needs a running codec)");
+        opus_codec_destroy(x->sweep_reference);
+        x->sweep_reference = NULL;
+        x->sweep_thread = NULL;
+        atomic_store_explicit(&x->sweep_state, SWEEP_IDLE, memory_order_release);
+    }
+}
+
+// Worker thread: reads only the capture buffers, reference and targets,
+// which the main thread leaves alone while the state is SWEEP_ANALYZING
+void *opuscodec_sweep_worker(t_opuscodec *x) {
+    x->sweep_status = opus_quality_sweep(x->sweep_reference, x->sweep_left, x->sweep_right,
+                                         (int)x->sweep_length, x->sweep_min_snr, x->sweep_max_lsd,
+                                         &x->sweep_cancel, &x->sweep_result);
+    qelem_set(x->sweep_done_qelem);
+    systhread_exit(0);
+    return NULL;
+}
+
+// Output: sweep <bitrate> <complexity> <avg snr> <avg lsd>
+void opuscodec_sweep_done(t_opuscodec *x) {
+    if (!x->sweep_thread) return;
+    
+    unsigned int ret;
+    systhread_join(x->sweep_thread, &ret);
+    x->sweep_thread = NULL;
+    opus_codec_destroy(x->sweep_reference);
+    x->sweep_reference = NULL;
+    
+    t_opus_sweep_result *result = &x->sweep_result;
+    if (atomic_load(&x->sweep_cancel)) {
+        post("opuscodec~: Sweep result discarded");
+    } else if (x->sweep_status == OPUS_CODEC_OK) {
+        t_atom av[4];
+        atom_setlong(av, result->bitrate);
+        atom_setlong(av + 1, result->complexity);
+        atom_setfloat(av + 2, result->segmental_snr);
+        atom_setfloat(av + 3, result->log_spectral_distance);
+        outlet_anything(x->info_outlet, gensym("sweep"), 4, av);
+        
+        post("opuscodec~: Sweep result - bitrate=%d, complexity=%d (SNR %.1f dB, LSD %.2f dB, %d runs)",
+             result->bitrate, result->complexity, result->segmental_snr, result->log_spectral_distance, result->runs);
+    } else {
+        object_error((t_object *)x, "Sweep found no settings reaching the target (or input was silent)");
+    }
+    
+    atomic_store_explicit(&x->sweep_state, SWEEP_IDLE, memory_order_release);
+}
+
 // Attributes abandoned - using proven message system only
\ No newline at end of file